@@ -0,0 +1,303 @@
+/*
+ * Benchmarks of the xvfbsync submission path against the in-process fake
+ * sync ip (tools/xvfbsync_fakedev.c), so they can run without a board.
+ *
+ * usage: xvfbsync_bench [-n iterations] [-p producer_us] [-c consumer_us]
+ *                       [-k ioctl_cost_ns] [-s async_spin_ns]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "xvfbsync_fakedev.h"
+
+#define BENCH_NUM_BUFFERS 4
+
+struct BenchOptions
+{
+  int iterations;
+  uint64_t spinNs;
+  struct FakeSyncIpConfig1 device;
+};
+
+struct BenchThread
+{
+  struct SyncIp1* syncIP;
+  struct FakeSyncIp1* dev;
+  int chanId;
+  int iterations;
+  bool async;
+  uint64_t spinNs;
+  uint64_t* samples;
+};
+
+static uint64_t bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int bench_compare (const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_report (const char* name, uint64_t* samples, int numSamples)
+{
+  if (numSamples <= 0)
+    return;
+
+  qsort (samples, numSamples, sizeof (uint64_t), &bench_compare);
+
+  const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+  printf ("%-28s n=%-8d", name, numSamples);
+
+  for (size_t i = 0; i < sizeof (percentiles) / sizeof (percentiles[0]); ++i)
+  {
+    int rank = (int)(percentiles[i] / 100.0 * (numSamples - 1) + 0.5);
+    printf (" p%g=%" PRIu64 "ns", percentiles[i], samples[rank]);
+  }
+
+  printf (" max=%" PRIu64 "ns\n", samples[numSamples - 1]);
+}
+
+static LLP2Buf* bench_createBuffer (uint32_t phyAddr)
+{
+  LLP2Buf* buf = calloc (1, sizeof (LLP2Buf));
+
+  buf->phyAddr = phyAddr;
+  buf->tFourCC = XVFBSYNC_FOURCC2('N', 'V', '1', '2');
+  buf->tDim.iWidth = 1920;
+  buf->tDim.iHeight = 1080;
+  buf->tPlanes[PLANE_Y].iOffset = 0;
+  buf->tPlanes[PLANE_Y].iPitch = 2048;
+  buf->tPlanes[PLANE_UV].iOffset = 2048 * 1088;
+  buf->tPlanes[PLANE_UV].iPitch = 2048;
+  return buf;
+}
+
+static void bench_startEncoder (struct EncSyncChannel1* encSyncChan, struct SyncIp1* syncIP, int chanId, bool async, uint64_t spinNs)
+{
+  LLP2Buf* bufs[BENCH_NUM_BUFFERS];
+
+  for (int i = 0; i < BENCH_NUM_BUFFERS; ++i)
+    bufs[i] = bench_createBuffer (0x10000000 + (chanId * BENCH_NUM_BUFFERS + i) * 0x01000000);
+
+  xvfbsync_encSyncChan_populate (encSyncChan, syncIP, chanId, 256, 64);
+  xvfbsync_encSyncChan_addBuffers (encSyncChan, bufs, BENCH_NUM_BUFFERS);
+
+  if (async) {
+    struct AsyncSubmit1 config = { .capacity = XVFBSYNC_ASYNC_DEFAULT_CAPACITY, .spinNs = spinNs };
+    xvfbsync_encSyncChan_setAsync (encSyncChan, &config);
+  }
+
+  xvfbsync_encSyncChan_enable (encSyncChan);
+}
+
+/* One encoder: wait for a free framebuffer like the encoder would wait
+ * for its next frame, then time the submission of the next buffer. In
+ * async mode only the push on the submission ring is timed */
+static void* bench_submitRoutine (void* arg)
+{
+  struct BenchThread* thread = arg;
+  struct EncSyncChannel1 encSyncChan;
+  uint64_t ticket = 0;
+
+  bench_startEncoder (&encSyncChan, thread->syncIP, thread->chanId, thread->async, thread->spinNs);
+
+  for (int i = 0; i < thread->iterations; ++i)
+  {
+    /* the previous buffer has to be programmed before the slot is seen busy */
+    while (thread->async && !xvfbsync_encSyncChan_isSubmitted (&encSyncChan, ticket))
+      sched_yield ();
+
+    xvfbsync_fakedev_waitFreeSlot (thread->dev, thread->chanId);
+
+    uint64_t start = bench_now ();
+
+    if (thread->async)
+      ticket = xvfbsync_encSyncChan_submit (&encSyncChan, NULL);
+    else
+      xvfbsync_encSyncChan_addBuffer (&encSyncChan, NULL);
+
+    thread->samples[i] = bench_now () - start;
+  }
+
+  xvfbsync_encSyncChan_depopulate (&encSyncChan);
+  return NULL;
+}
+
+static int bench_populate (struct SyncIp1* syncIP, struct FakeSyncIp1** dev, const struct BenchOptions* options)
+{
+  *dev = xvfbsync_fakedev_create (&options->device);
+
+  if (!*dev) {
+    fprintf (stderr, "Couldn't create the fake sync ip\n");
+    return -1;
+  }
+
+  if (xvfbsync_syncIP_populateWithOps (syncIP, xvfbsync_fakedev_getFd (*dev), &xvfbsync_fakedev_ops, *dev)) {
+    fprintf (stderr, "Couldn't populate the sync ip\n");
+    xvfbsync_fakedev_destroy (*dev);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void bench_depopulate (struct SyncIp1* syncIP, struct FakeSyncIp1* dev)
+{
+  xvfbsync_syncIP_depopulate (syncIP);
+  xvfbsync_fakedev_destroy (dev);
+}
+
+static void bench_submit (const struct BenchOptions* options, int numChannels, bool async)
+{
+  struct SyncIp1 syncIP;
+  struct FakeSyncIp1* dev;
+
+  if (bench_populate (&syncIP, &dev, options))
+    return;
+
+  struct BenchThread threads[XVSFSYNC_MAX_ENC_CHANNEL];
+  pthread_t tids[XVSFSYNC_MAX_ENC_CHANNEL];
+  uint64_t* samples = calloc ((size_t)numChannels * options->iterations, sizeof (uint64_t));
+  uint64_t start = bench_now ();
+
+  for (int i = 0; i < numChannels; ++i)
+  {
+    threads[i].syncIP = &syncIP;
+    threads[i].dev = dev;
+    threads[i].chanId = i;
+    threads[i].iterations = options->iterations;
+    threads[i].async = async;
+    threads[i].spinNs = options->spinNs;
+    threads[i].samples = samples + (size_t)i * options->iterations;
+    pthread_create (&tids[i], NULL, &bench_submitRoutine, &threads[i]);
+  }
+
+  for (int i = 0; i < numChannels; ++i)
+    pthread_join (tids[i], NULL);
+
+  double elapsed = (bench_now () - start) / 1e9;
+  char name[64];
+  snprintf (name, sizeof (name), "submit%s (%d channel%s)", async ? " async" : "", numChannels, numChannels > 1 ? "s" : "");
+  bench_report (name, samples, numChannels * options->iterations);
+  printf ("%-28s %.0f buffers/s\n", "", numChannels * options->iterations / elapsed);
+
+  free (samples);
+  bench_depopulate (&syncIP, dev);
+}
+
+static void bench_enable (const struct BenchOptions* options)
+{
+  struct SyncIp1 syncIP;
+  struct FakeSyncIp1* dev;
+
+  if (bench_populate (&syncIP, &dev, options))
+    return;
+
+  uint64_t* samples = calloc (options->iterations, sizeof (uint64_t));
+
+  for (int i = 0; i < options->iterations; ++i)
+  {
+    struct EncSyncChannel1 encSyncChan;
+    LLP2Buf* bufs[BENCH_NUM_BUFFERS];
+
+    for (int j = 0; j < BENCH_NUM_BUFFERS; ++j)
+      bufs[j] = bench_createBuffer (0x10000000 + j * 0x01000000);
+
+    xvfbsync_encSyncChan_populate (&encSyncChan, &syncIP, 0, 256, 64);
+    xvfbsync_encSyncChan_addBuffers (&encSyncChan, bufs, BENCH_NUM_BUFFERS);
+
+    uint64_t start = bench_now ();
+    xvfbsync_encSyncChan_enable (&encSyncChan);
+    samples[i] = bench_now () - start;
+
+    xvfbsync_encSyncChan_depopulate (&encSyncChan);
+  }
+
+  bench_report ("enable", samples, options->iterations);
+  free (samples);
+  bench_depopulate (&syncIP, dev);
+}
+
+static void bench_getFreeChannel (const struct BenchOptions* options)
+{
+  struct SyncIp1 syncIP;
+  struct FakeSyncIp1* dev;
+
+  if (bench_populate (&syncIP, &dev, options))
+    return;
+
+  uint64_t* samples = calloc (options->iterations, sizeof (uint64_t));
+
+  for (int i = 0; i < options->iterations; ++i)
+  {
+    uint64_t start = bench_now ();
+    int chanId = xvfbsync_syncIP_getFreeChannel (&syncIP);
+    samples[i] = bench_now () - start;
+    xvfbsync_syncIP_releaseChannel (&syncIP, chanId);
+  }
+
+  bench_report ("getFreeChannel", samples, options->iterations);
+  free (samples);
+  bench_depopulate (&syncIP, dev);
+}
+
+static void bench_usage (const char* name)
+{
+  fprintf (stderr, "usage: %s [-n iterations] [-p producer_us] [-c consumer_us] [-k ioctl_cost_ns] [-s async_spin_ns]\n", name);
+}
+
+int main (int argc, char** argv)
+{
+  struct BenchOptions options;
+  int opt;
+
+  memset (&options, 0, sizeof (options));
+  options.iterations = 10000;
+  options.device.encode = true;
+  options.device.maxChannels = XVSFSYNC_MAX_ENC_CHANNEL;
+  options.device.producerDelayNs = 20000;
+  options.device.consumerDelayNs = 40000;
+  options.spinNs = XVFBSYNC_ASYNC_DEFAULT_SPIN_NS;
+
+  while ((opt = getopt (argc, argv, "n:p:c:k:s:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': options.iterations = atoi (optarg); break;
+    case 'p': options.device.producerDelayNs = strtoull (optarg, NULL, 0) * 1000; break;
+    case 'c': options.device.consumerDelayNs = strtoull (optarg, NULL, 0) * 1000; break;
+    case 'k': options.device.ioctlCostNs = strtoull (optarg, NULL, 0); break;
+    case 's': options.spinNs = strtoull (optarg, NULL, 0); break;
+    default: bench_usage (argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (options.iterations <= 0) {
+    bench_usage (argv[0]);
+    return 1;
+  }
+
+  printf ("iterations: %d, producer done: %" PRIu64 "us, consumer done: %" PRIu64 "us, ioctl cost: %" PRIu64 "ns, async spin: %" PRIu64 "ns\n",
+    options.iterations, options.device.producerDelayNs / 1000, options.device.consumerDelayNs / 1000, options.device.ioctlCostNs, options.spinNs);
+
+  bench_enable (&options);
+  bench_getFreeChannel (&options);
+
+  for (int numChannels = 1; numChannels <= XVSFSYNC_MAX_ENC_CHANNEL; ++numChannels)
+    bench_submit (&options, numChannels, false);
+
+  for (int numChannels = 1; numChannels <= XVSFSYNC_MAX_ENC_CHANNEL; ++numChannels)
+    bench_submit (&options, numChannels, true);
+
+  return 0;
+}
@@ -0,0 +1,784 @@
+/*
+ * Checks the framebuffer configs the library programs against the
+ * in-process fake sync ip (tools/xvfbsync_fakedev.c): luma/chroma start
+ * and end addresses of each user and the per-core offsets, for raster,
+ * tiled, 10-bit packed and planar layouts. The expected values are worked
+ * out by hand from the buffer layouts, not with the library helpers.
+ * Then drives channels through the fake device events (completions and
+ * injected errors) and checks how the library reacts.
+ *
+ * usage: xvfbsync_check
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "xvfbsync_fakedev.h"
+
+#define CHECK_PHY_ADDR 0x10000000
+#define CHECK_HORIZONTAL_ALIGNMENT 256
+#define CHECK_VERTICAL_ALIGNMENT 64
+#define CHECK_TIMEOUT_NS 2000000000 /* longest wait for an event */
+#define CHECK_RESERVING_THREADS 8
+
+struct CheckCase
+{
+  const char* name;
+  bool encode;
+  uint32_t tFourCC;
+  int width;
+  int height;
+  int lumaPitch;
+  int chromaPitch;
+  int chromaOffset;
+  int lcuSize; /* decoder only */
+  struct CoreSplit1 split;
+  /* offsets from CHECK_PHY_ADDR, [user][0: start, 1: end] */
+  uint64_t luma[XVSFSYNC_IO][2];
+  uint64_t chroma[XVSFSYNC_IO][2];
+  uint32_t lumaCoreOffsets[XVSFSYNC_MAX_CORES];
+  uint32_t chromaCoreOffsets[XVSFSYNC_MAX_CORES];
+};
+
+#define NV12_CHROMA (2048 * 1088)
+#define T608_PITCH (30 * 64 * 4) /* 30 tiles of 64x4 bytes per tile row */
+#define T608_CHROMA (T608_PITCH * 270)
+#define T60A_PITCH (30 * 64 * 4 * 10 / 8)
+#define T60A_CHROMA (T60A_PITCH * 270)
+#define XV15_CHROMA (1408 * 600)
+#define XV20_CHROMA (2560 * 1088)
+#define I420_CHROMA (2048 * 1080)
+#define I420_V_PLANE (1024 * 540) /* the second chroma plane follows the first one */
+#define P010_CHROMA (4096 * 1088)
+
+static const struct CheckCase CheckCases[] =
+{
+  {
+    /* the consumer reads 2048 bytes lines over 1088 lines (544 for chroma) */
+    "NV12 encoder, rows", true, XVFBSYNC_FOURCC2('N', 'V', '1', '2'), 1920, 1080, 2048, 2048, NV12_CHROMA, 0,
+    { 2, CORE_PARTITION_ROWS, 16 },
+    { { 0, 1079 * 2048 + 1919 }, { 0, 1087 * 2048 + 2047 } },
+    { { NV12_CHROMA, NV12_CHROMA + 539 * 2048 + 1919 }, { NV12_CHROMA, NV12_CHROMA + 543 * 2048 + 2047 } },
+    /* 68 slices of 16 lines, the second core starts on line 34 * 16 */
+    { 0, 544 * 2048 }, { 0, 272 * 2048 },
+  },
+  {
+    "NV12 decoder, columns", false, XVFBSYNC_FOURCC2('N', 'V', '1', '2'), 1920, 1080, 2048, 2048, NV12_CHROMA, 0,
+    { 3, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 1079 * 2048 + 1919 }, { 0, 1079 * 2048 + 1919 } },
+    { { NV12_CHROMA, NV12_CHROMA + 539 * 2048 + 1919 }, { NV12_CHROMA, NV12_CHROMA + 539 * 2048 + 1919 } },
+    /* 30 LCU columns, 10 per core, the chroma samples interleave U and V */
+    { 0, 640, 1280 }, { 0, 640, 1280 },
+  },
+  {
+    "T608 decoder, columns", false, XVFBSYNC_FOURCC2('T', '6', '0', '8'), 1920, 1080, T608_PITCH, T608_PITCH, T608_CHROMA, 0,
+    { 2, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 270 * T608_PITCH - 1 }, { 0, 270 * T608_PITCH - 1 } },
+    { { T608_CHROMA, T608_CHROMA + 135 * T608_PITCH - 1 }, { T608_CHROMA, T608_CHROMA + 135 * T608_PITCH - 1 } },
+    /* 30 LCU columns, the second core starts on tile 15 */
+    { 0, 15 * 256 }, { 0, 15 * 256 },
+  },
+  {
+    /* the producer writes the whole last LCU row: 1088 lines */
+    "T608 decoder, 64 LCU", false, XVFBSYNC_FOURCC2('T', '6', '0', '8'), 1920, 1080, T608_PITCH, T608_PITCH, T608_CHROMA, 64,
+    { 1, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 272 * T608_PITCH - 1 }, { 0, 270 * T608_PITCH - 1 } },
+    { { T608_CHROMA, T608_CHROMA + 136 * T608_PITCH - 1 }, { T608_CHROMA, T608_CHROMA + 135 * T608_PITCH - 1 } },
+    { 0 }, { 0 },
+  },
+  {
+    /* tiles of 64x4 10-bit pixels are 320 bytes, read by whole tile rows */
+    "T60A encoder", true, XVFBSYNC_FOURCC2('T', '6', '0', 'A'), 1920, 1080, T60A_PITCH, T60A_PITCH, T60A_CHROMA, 0,
+    { 1, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 270 * T60A_PITCH - 1 }, { 0, 272 * T60A_PITCH - 1 } },
+    { { T60A_CHROMA, T60A_CHROMA + 135 * T60A_PITCH - 1 }, { T60A_CHROMA, T60A_CHROMA + 136 * T60A_PITCH - 1 } },
+    { 0 }, { 0 },
+  },
+  {
+    /* 1000 pixels take 334 words of 3 pixels: 1336 bytes, 1344 once
+     * rounded to the 64 bytes bursts of the producer over 640 lines */
+    "XV15 decoder, 64 LCU, columns", false, XVFBSYNC_FOURCC2('X', 'V', '1', '5'), 1000, 600, 1408, 1408, XV15_CHROMA, 64,
+    { 2, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 639 * 1408 + 1343 }, { 0, 599 * 1408 + 1335 } },
+    { { XV15_CHROMA, XV15_CHROMA + 319 * 1408 + 1343 }, { XV15_CHROMA, XV15_CHROMA + 299 * 1408 + 1335 } },
+    /* 16 LCU columns, the second core starts on pixel 512, in word 170 */
+    { 0, 170 * 4 }, { 0, 170 * 4 },
+  },
+  {
+    /* 1920 pixels take 640 words: 2560 bytes, 4:2:2 chroma has all the lines */
+    "XV20 encoder", true, XVFBSYNC_FOURCC2('X', 'V', '2', '0'), 1920, 1080, 2560, 2560, XV20_CHROMA, 0,
+    { 1, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 1079 * 2560 + 2559 }, { 0, 1087 * 2560 + 2559 } },
+    { { XV20_CHROMA, XV20_CHROMA + 1079 * 2560 + 2559 }, { XV20_CHROMA, XV20_CHROMA + 1087 * 2560 + 2559 } },
+    { 0 }, { 0 },
+  },
+  {
+    /* the chroma range ends on the last line of the V plane */
+    "I420 encoder, columns", true, XVFBSYNC_FOURCC2('I', '4', '2', '0'), 1920, 1080, 2048, 1024, I420_CHROMA, 0,
+    { 2, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 1079 * 2048 + 1919 }, { 0, 1087 * 2048 + 2047 } },
+    { { I420_CHROMA, I420_CHROMA + I420_V_PLANE + 539 * 1024 + 959 }, { I420_CHROMA, I420_CHROMA + I420_V_PLANE + 543 * 1024 + 1023 } },
+    /* planar chroma columns are half as wide */
+    { 0, 960 }, { 0, 480 },
+  },
+  {
+    "YV12 decoder, columns", false, XVFBSYNC_FOURCC2('Y', 'V', '1', '2'), 1920, 1080, 2048, 1024, I420_CHROMA, 0,
+    { 4, CORE_PARTITION_COLUMNS, 64 },
+    { { 0, 1079 * 2048 + 1919 }, { 0, 1079 * 2048 + 1919 } },
+    { { I420_CHROMA, I420_CHROMA + I420_V_PLANE + 539 * 1024 + 959 }, { I420_CHROMA, I420_CHROMA + I420_V_PLANE + 539 * 1024 + 959 } },
+    /* 30 LCU columns spread as 7, 8, 7 and 8 */
+    { 0, 448, 960, 1408 }, { 0, 224, 480, 704 },
+  },
+  {
+    "P010 decoder, rows", false, XVFBSYNC_FOURCC2('P', '0', '1', '0'), 1920, 1080, 4096, 4096, P010_CHROMA, 0,
+    { 3, CORE_PARTITION_ROWS, 64 },
+    { { 0, 1079 * 4096 + 3839 }, { 0, 1079 * 4096 + 3839 } },
+    { { P010_CHROMA, P010_CHROMA + 539 * 4096 + 3839 }, { P010_CHROMA, P010_CHROMA + 539 * 4096 + 3839 } },
+    /* 17 bands of 64 lines spread as 5, 6 and 6 */
+    { 0, 320 * 4096, 704 * 4096 }, { 0, 160 * 4096, 352 * 4096 },
+  },
+};
+
+static LLP2Buf* check_createBuffer (const struct CheckCase* test)
+{
+  LLP2Buf* buf = calloc (1, sizeof (LLP2Buf));
+
+  buf->phyAddr = CHECK_PHY_ADDR;
+  buf->tFourCC = test->tFourCC;
+  buf->tDim.iWidth = test->width;
+  buf->tDim.iHeight = test->height;
+  buf->tPlanes[PLANE_Y].iOffset = 0;
+  buf->tPlanes[PLANE_Y].iPitch = test->lumaPitch;
+  buf->tPlanes[PLANE_UV].iOffset = test->chromaOffset;
+  buf->tPlanes[PLANE_UV].iPitch = test->chromaPitch;
+  return buf;
+}
+
+/* Program a single buffer of test on channel 0 and read its config back */
+static int check_program (const struct CheckCase* test, struct xvsfsync_chan_config* config)
+{
+  struct FakeSyncIpConfig1 device;
+
+  memset (&device, 0, sizeof (device));
+  device.encode = test->encode;
+  device.maxChannels = XVSFSYNC_MAX_ENC_CHANNEL;
+  device.producerDelayNs = 1000000000;
+  device.consumerDelayNs = 1000000000;
+
+  struct FakeSyncIp1* dev = xvfbsync_fakedev_create (&device);
+  struct SyncIp1 syncIP;
+
+  if (!dev || xvfbsync_syncIP_populateWithOps (&syncIP, xvfbsync_fakedev_getFd (dev), &xvfbsync_fakedev_ops, dev)) {
+    fprintf (stderr, "Couldn't create the fake sync ip\n");
+    xvfbsync_fakedev_destroy (dev);
+    return -1;
+  }
+
+  LLP2Buf* buf = check_createBuffer (test);
+  int ret = -1;
+
+  if (test->encode)
+  {
+    struct EncSyncChannel1 encSyncChan;
+
+    if (!xvfbsync_encSyncChan_populate (&encSyncChan, &syncIP, 0, CHECK_HORIZONTAL_ALIGNMENT, CHECK_VERTICAL_ALIGNMENT))
+    {
+      /* the channel owns the buffer from here */
+      if (!xvfbsync_encSyncChan_setCoreSplit (&encSyncChan, &test->split) && !xvfbsync_encSyncChan_addBuffers (&encSyncChan, &buf, 1)) {
+        xvfbsync_encSyncChan_enable (&encSyncChan);
+        ret = xvfbsync_fakedev_getLastConfig (dev, 0, config);
+      }
+
+      xvfbsync_encSyncChan_depopulate (&encSyncChan);
+    }
+  }
+  else
+  {
+    struct DecSyncChannel1 decSyncChan;
+
+    if (!xvfbsync_decSyncChan_populate (&decSyncChan, &syncIP, 0))
+    {
+      if (!xvfbsync_decSyncChan_setCoreSplit (&decSyncChan, &test->split) && !xvfbsync_decSyncChan_setLcuSize (&decSyncChan, test->lcuSize)) {
+        xvfbsync_decSyncChan_addBuffer (&decSyncChan, buf);
+        xvfbsync_decSyncChan_enable (&decSyncChan);
+        ret = xvfbsync_fakedev_getLastConfig (dev, 0, config);
+      }
+
+      xvfbsync_decSyncChan_depopulate (&decSyncChan);
+    }
+
+    free (buf);
+  }
+
+  xvfbsync_syncIP_depopulate (&syncIP);
+  xvfbsync_fakedev_destroy (dev);
+  return ret;
+}
+
+static int check_value (const char* name, const char* field, uint64_t value, uint64_t expected)
+{
+  if (value == expected)
+    return 0;
+
+  printf ("%s: %s is 0x%" PRIx64 ", expected 0x%" PRIx64 "\n", name, field, value, expected);
+  return 1;
+}
+
+static int check_run (const struct CheckCase* test)
+{
+  struct xvsfsync_chan_config config;
+
+  if (check_program (test, &config)) {
+    printf ("%s: no config was programmed\n", test->name);
+    return 1;
+  }
+
+  static const char* const Users[XVSFSYNC_IO] = { "producer", "consumer" };
+  int failures = 0;
+  char field[64];
+
+  for (int user = 0; user < XVSFSYNC_IO; ++user)
+  {
+    snprintf (field, sizeof (field), "%s luma start", Users[user]);
+    failures += check_value (test->name, field, config.luma_start_address[user], CHECK_PHY_ADDR + test->luma[user][0]);
+    snprintf (field, sizeof (field), "%s luma end", Users[user]);
+    failures += check_value (test->name, field, config.luma_end_address[user], CHECK_PHY_ADDR + test->luma[user][1]);
+    snprintf (field, sizeof (field), "%s chroma start", Users[user]);
+    failures += check_value (test->name, field, config.chroma_start_address[user], CHECK_PHY_ADDR + test->chroma[user][0]);
+    snprintf (field, sizeof (field), "%s chroma end", Users[user]);
+    failures += check_value (test->name, field, config.chroma_end_address[user], CHECK_PHY_ADDR + test->chroma[user][1]);
+  }
+
+  for (int core = 0; core < XVSFSYNC_MAX_CORES; ++core)
+  {
+    snprintf (field, sizeof (field), "core %d luma offset", core);
+    failures += check_value (test->name, field, config.luma_core_offset[core], test->lumaCoreOffsets[core]);
+    snprintf (field, sizeof (field), "core %d chroma offset", core);
+    failures += check_value (test->name, field, config.chroma_core_offset[core], test->chromaCoreOffsets[core]);
+  }
+
+  printf ("%-32s %s\n", test->name, failures ? "FAILED" : "ok");
+  return failures;
+}
+
+/* The behaviour checks run the sync ip without a thread and handle its
+ * events themselves, so they see every event the channel got */
+struct CheckDevice
+{
+  struct FakeSyncIp1* dev;
+  struct SyncIp1 syncIP;
+};
+
+struct BehaviourCheck
+{
+  const char* name;
+  int (*run) (const char* name);
+};
+
+static uint64_t check_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int check_openDevice (struct CheckDevice* device, bool encode, uint64_t producerDelayNs, uint64_t consumerDelayNs)
+{
+  struct FakeSyncIpConfig1 config;
+  struct SyncIpOptions1 options;
+
+  memset (&config, 0, sizeof (config));
+  config.encode = encode;
+  config.maxChannels = encode ? XVSFSYNC_MAX_ENC_CHANNEL : XVSFSYNC_MAX_DEC_CHANNEL;
+  config.producerDelayNs = producerDelayNs;
+  config.consumerDelayNs = consumerDelayNs;
+  memset (&options, 0, sizeof (options));
+  options.eThreading = THREADING_NONE;
+
+  device->dev = xvfbsync_fakedev_create (&config);
+
+  if (!device->dev || xvfbsync_syncIP_populateWithOptions (&device->syncIP, xvfbsync_fakedev_getFd (device->dev), &xvfbsync_fakedev_ops, device->dev, &options)) {
+    fprintf (stderr, "Couldn't create the fake sync ip\n");
+    xvfbsync_fakedev_destroy (device->dev);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void check_closeDevice (struct CheckDevice* device)
+{
+  xvfbsync_syncIP_depopulate (&device->syncIP);
+  xvfbsync_fakedev_destroy (device->dev);
+}
+
+/* An NV12 1080p buffer, index selects its address */
+static LLP2Buf* check_createFrame (int index)
+{
+  static const struct CheckCase Frame =
+  {
+    "frame", true, XVFBSYNC_FOURCC2('N', 'V', '1', '2'), 1920, 1080, 2048, 2048, NV12_CHROMA, 0,
+  };
+  LLP2Buf* buf = check_createBuffer (&Frame);
+
+  buf->phyAddr += index * 0x1000000;
+  return buf;
+}
+
+static uint32_t check_drainEncoder (void* encSyncChan)
+{
+  return xvfbsync_encSyncChan_drainEvents (encSyncChan);
+}
+
+static uint32_t check_drainDecoder (void* decSyncChan)
+{
+  return xvfbsync_decSyncChan_drainEvents (decSyncChan);
+}
+
+/* Handle the device events until one of wanted fired on the channel
+ * drained by drain, returns the events seen meanwhile (0 on timeout).
+ * numFrames counts the released slots */
+static uint32_t check_wait (struct CheckDevice* device, uint32_t (*drain) (void*), void* channel, uint32_t wanted, int* numFrames)
+{
+  uint64_t deadline = check_now () + CHECK_TIMEOUT_NS;
+  uint32_t seen = 0;
+
+  while (!(seen & wanted) && check_now () < deadline)
+  {
+    if (xvfbsync_syncIP_processEvents (&device->syncIP, 1))
+      return 0;
+
+    uint32_t events = drain (channel);
+
+    if (numFrames)
+      *numFrames += __builtin_popcount (events & XVFBSYNC_EVENT_FB_DONE_MASK);
+    seen |= events;
+  }
+
+  return (seen & wanted) ? seen : 0;
+}
+
+/* Handle the device events until the decoder programmed all its queued
+ * buffers, returns -1 on timeout */
+static int check_waitPending (struct CheckDevice* device, struct DecSyncChannel1* decSyncChan)
+{
+  uint64_t deadline = check_now () + CHECK_TIMEOUT_NS;
+
+  while (xvfbsync_decSyncChan_getNumPending (decSyncChan))
+  {
+    if (check_now () >= deadline || xvfbsync_syncIP_processEvents (&device->syncIP, 1))
+      return -1;
+  }
+
+  return 0;
+}
+
+static int check_fail (const char* name, const char* what)
+{
+  printf ("%s: %s\n", name, what);
+  return 1;
+}
+
+/* The first restart is immediate, the following one waits for the
+ * backoff, the channel gives up after maxRetries restarts without a frame */
+static int check_recovery (const char* name)
+{
+  static const uint64_t Backoff = 100000000;
+  struct CheckDevice device;
+  struct EncSyncChannel1 encSyncChan;
+  struct RecoveryPolicy1 policy = { .maxRetries = 2, .backoffNs = Backoff, .maxBackoffNs = 2 * Backoff };
+  struct RecoveryStats1 stats;
+  LLP2Buf* bufs[4];
+  int failures = 0;
+  int numFrames = 0;
+
+  if (check_openDevice (&device, true, 5000000, 10000000))
+    return 1;
+
+  for (int i = 0; i < 4; ++i)
+    bufs[i] = check_createFrame (i);
+
+  xvfbsync_encSyncChan_populate (&encSyncChan, &device.syncIP, 0, CHECK_HORIZONTAL_ALIGNMENT, CHECK_VERTICAL_ALIGNMENT);
+  xvfbsync_encSyncChan_setAutoRecycle (&encSyncChan, true);
+  xvfbsync_encSyncChan_setRecovery (&encSyncChan, &policy);
+  xvfbsync_encSyncChan_addBuffers (&encSyncChan, bufs, 4);
+  xvfbsync_encSyncChan_enable (&encSyncChan);
+
+  if (!check_wait (&device, check_drainEncoder, &encSyncChan, XVFBSYNC_EVENT_FB_DONE_MASK, &numFrames))
+    failures += check_fail (name, "no frame completed");
+
+  xvfbsync_fakedev_injectError (device.dev, 0);
+  uint64_t start = check_now ();
+
+  if (!check_wait (&device, check_drainEncoder, &encSyncChan, XVFBSYNC_EVENT_RECOVERED, NULL))
+    failures += check_fail (name, "the first error wasn't recovered");
+  else if (check_now () - start >= Backoff)
+    failures += check_fail (name, "the first restart waited for the backoff");
+
+  /* before a frame completes, so the next restart backs off */
+  xvfbsync_fakedev_injectError (device.dev, 0);
+  start = check_now ();
+
+  if (!check_wait (&device, check_drainEncoder, &encSyncChan, XVFBSYNC_EVENT_RECOVERED, NULL))
+    failures += check_fail (name, "the second error wasn't recovered");
+  else if (check_now () - start < Backoff)
+    failures += check_fail (name, "the second restart didn't wait for the backoff");
+
+  xvfbsync_fakedev_injectError (device.dev, 0);
+
+  if (!check_wait (&device, check_drainEncoder, &encSyncChan, XVFBSYNC_EVENT_RECOVERY_FAILED, NULL))
+    failures += check_fail (name, "the channel didn't give up");
+
+  xvfbsync_encSyncChan_getRecoveryStats (&encSyncChan, &stats);
+  failures += check_value (name, "errors", stats.errors, 3);
+  failures += check_value (name, "recoveries", stats.recoveries, 2);
+  failures += check_value (name, "failures", stats.failures, 1);
+
+  xvfbsync_encSyncChan_depopulate (&encSyncChan);
+  check_closeDevice (&device);
+  return failures;
+}
+
+/* Released slots are reprogrammed without addBuffer, with every buffer of
+ * the channel in turn (the fourth buffer only gets a slot that way) */
+static int check_autoRecycle (const char* name)
+{
+  static struct TraceEvent1 Events[XVFBSYNC_TRACE_SIZE];
+  struct CheckDevice device;
+  struct EncSyncChannel1 encSyncChan;
+  LLP2Buf* bufs[4];
+  int failures = 0;
+  int numFrames = 0;
+  int numProgrammed = 0;
+  uint32_t programmed = 0;
+
+  if (check_openDevice (&device, true, 1000000, 2000000))
+    return 1;
+
+  for (int i = 0; i < 4; ++i)
+    bufs[i] = check_createFrame (i);
+
+  xvfbsync_encSyncChan_populate (&encSyncChan, &device.syncIP, 0, CHECK_HORIZONTAL_ALIGNMENT, CHECK_VERTICAL_ALIGNMENT);
+  xvfbsync_encSyncChan_setAutoRecycle (&encSyncChan, true);
+  xvfbsync_encSyncChan_addBuffers (&encSyncChan, bufs, 4);
+  xvfbsync_encSyncChan_enable (&encSyncChan);
+
+  uint64_t ioctls = xvfbsync_fakedev_getIoctlCount (device.dev);
+
+  /* each buffer goes through the slots several times */
+  while (numFrames < 4 * XVSFSYNC_BUF_PER_CHANNEL)
+  {
+    if (!check_wait (&device, check_drainEncoder, &encSyncChan, XVFBSYNC_EVENT_FB_DONE_MASK, &numFrames)) {
+      failures += check_fail (name, "the slots weren't recycled");
+      break;
+    }
+  }
+
+  int numEvents = xvfbsync_syncIP_traceSnapshot (&device.syncIP, Events, XVFBSYNC_TRACE_SIZE);
+
+  for (int i = 0; i < numEvents; ++i)
+  {
+    if (Events[i].type != TRACE_BUFFER_PROGRAMMED || Events[i].result)
+      continue;
+
+    programmed |= BIT((Events[i].arg - CHECK_PHY_ADDR) / 0x1000000);
+    ++numProgrammed;
+  }
+
+  failures += check_value (name, "programmed buffers", programmed, 0xf);
+
+  if (numProgrammed < XVSFSYNC_BUF_PER_CHANNEL + numFrames)
+    failures += check_fail (name, "released slots weren't reprogrammed");
+
+  /* at least one config per released slot */
+  if (xvfbsync_fakedev_getIoctlCount (device.dev) - ioctls < (uint64_t)numFrames)
+    failures += check_fail (name, "fewer ioctls than recycled slots");
+
+  xvfbsync_encSyncChan_depopulate (&encSyncChan);
+  check_closeDevice (&device);
+  return failures;
+}
+
+static void check_addFrame (struct DecSyncChannel1* decSyncChan, int index, int height)
+{
+  LLP2Buf* buf = check_createFrame (index);
+
+  buf->tDim.iHeight = height;
+  xvfbsync_decSyncChan_addBuffer (decSyncChan, buf);
+  free (buf);
+}
+
+/* Queue 6 buffers on a decoder channel, 3 of them fit in the hardware
+ * slots. With completion tracking the slots are picked by the library,
+ * without it the driver searches them and the busy buffers are retried */
+static int check_decoderSlots (const char* name, bool trackFbDone)
+{
+  struct CheckDevice device;
+  struct DecSyncChannel1 decSyncChan;
+  struct xvsfsync_chan_config config;
+  int failures = 0;
+
+  if (check_openDevice (&device, false, 2000000, 4000000))
+    return 1;
+
+  /* as if the driver couldn't report the completions */
+  device.syncIP.trackFbDone = trackFbDone;
+
+  xvfbsync_decSyncChan_populate (&decSyncChan, &device.syncIP, 0);
+
+  for (int i = 0; i < 6; ++i)
+    check_addFrame (&decSyncChan, i, 1080);
+
+  xvfbsync_decSyncChan_enable (&decSyncChan);
+  failures += check_value (name, "pending buffers", xvfbsync_decSyncChan_getNumPending (&decSyncChan), 6 - XVSFSYNC_BUF_PER_CHANNEL);
+  xvfbsync_fakedev_getLastConfig (device.dev, 0, &config);
+  failures += check_value (name, "first slots", config.fb_id[XVSFSYNC_PROD], trackFbDone ? XVSFSYNC_BUF_PER_CHANNEL - 1 : XVSFSYNC_AUTO_SEARCH);
+
+  if (check_waitPending (&device, &decSyncChan))
+    failures += check_fail (name, "the queued buffers weren't programmed");
+
+  xvfbsync_fakedev_getLastConfig (device.dev, 0, &config);
+  failures += check_value (name, "last buffer", config.luma_start_address[XVSFSYNC_PROD], CHECK_PHY_ADDR + 5 * 0x1000000);
+  failures += check_value (name, "consumer slot", config.fb_id[XVSFSYNC_CONS], config.fb_id[XVSFSYNC_PROD]);
+
+  if (trackFbDone ? config.fb_id[XVSFSYNC_PROD] >= XVSFSYNC_BUF_PER_CHANNEL : config.fb_id[XVSFSYNC_PROD] != XVSFSYNC_AUTO_SEARCH)
+    failures += check_fail (name, "the last buffer went to the wrong slot");
+
+  /* a buffer ending before it starts is refused, the next one goes on */
+  check_addFrame (&decSyncChan, 6, 0);
+  check_addFrame (&decSyncChan, 7, 1080);
+
+  if (!check_wait (&device, check_drainDecoder, &decSyncChan, XVFBSYNC_EVENT_BUFFER_REJECTED, NULL))
+    failures += check_fail (name, "the refused buffer wasn't reported");
+
+  if (check_waitPending (&device, &decSyncChan))
+    failures += check_fail (name, "the buffer after the refused one wasn't programmed");
+
+  xvfbsync_fakedev_getLastConfig (device.dev, 0, &config);
+  failures += check_value (name, "buffer after the refused one", config.luma_start_address[XVSFSYNC_PROD], CHECK_PHY_ADDR + 7 * 0x1000000);
+
+  const struct StatsSegment1* stats = xvfbsync_syncIP_getStats (&device.syncIP);
+
+  if (stats)
+    failures += check_value (name, "rejected buffers", stats->channels[0].buffersRejected, 1);
+
+  xvfbsync_decSyncChan_depopulate (&decSyncChan);
+  check_closeDevice (&device);
+  return failures;
+}
+
+static int check_decoderTrackedSlots (const char* name)
+{
+  return check_decoderSlots (name, true);
+}
+
+static int check_decoderSearchedSlots (const char* name)
+{
+  return check_decoderSlots (name, false);
+}
+
+/* Keep a buffer queued on the decoder and handle one round of device
+ * events, returns the events of the channel. numFrames counts the
+ * released slots */
+static uint32_t check_feedDecoder (struct CheckDevice* device, struct DecSyncChannel1* decSyncChan, int* numFrames)
+{
+  static int index;
+
+  if (!xvfbsync_decSyncChan_getNumPending (decSyncChan))
+    check_addFrame (decSyncChan, index++ % 8, 1080);
+
+  xvfbsync_syncIP_processEvents (&device->syncIP, 1);
+
+  uint32_t events = xvfbsync_decSyncChan_drainEvents (decSyncChan);
+
+  *numFrames += __builtin_popcount (events & XVFBSYNC_EVENT_FB_DONE_MASK);
+  return events;
+}
+
+/* A sync error raises the margins by a step and doubles the quiet period,
+ * they come back down after that many error free frames */
+static int check_margins (const char* name)
+{
+  static const struct MarginControl1 Control = { .minMargin = 0, .maxMargin = 256, .step = 64, .quietFrames = 4 };
+  struct CheckDevice device;
+  struct DecSyncChannel1 decSyncChan;
+  struct RecoveryPolicy1 policy = { .maxRetries = 3, .backoffNs = 1000000, .maxBackoffNs = 1000000 };
+  struct xvsfsync_chan_config config;
+  uint32_t lumaMargin;
+  uint32_t chromaMargin;
+  int failures = 0;
+  int numFrames = 0;
+  bool programmedRaised = false;
+
+  if (check_openDevice (&device, false, 1000000, 2000000))
+    return 1;
+
+  xvfbsync_decSyncChan_populate (&decSyncChan, &device.syncIP, 0);
+  xvfbsync_decSyncChan_setAdaptiveMargins (&decSyncChan, &Control);
+  xvfbsync_decSyncChan_setRecovery (&decSyncChan, &policy);
+  xvfbsync_decSyncChan_enable (&decSyncChan);
+
+  uint64_t deadline = check_now () + CHECK_TIMEOUT_NS;
+
+  while (numFrames < 2 * Control.quietFrames && check_now () < deadline)
+    check_feedDecoder (&device, &decSyncChan, &numFrames);
+
+  xvfbsync_decSyncChan_getMargins (&decSyncChan, &lumaMargin, &chromaMargin);
+  failures += check_value (name, "luma margin without error", lumaMargin, 0);
+
+  xvfbsync_fakedev_injectError (device.dev, 0);
+
+  while (!(check_feedDecoder (&device, &decSyncChan, &numFrames) & XVFBSYNC_EVENT_SYNC_ERROR))
+  {
+    if (check_now () >= deadline) {
+      failures += check_fail (name, "the sync error wasn't reported");
+      break;
+    }
+  }
+
+  xvfbsync_decSyncChan_getMargins (&decSyncChan, &lumaMargin, &chromaMargin);
+  failures += check_value (name, "luma margin after the error", lumaMargin, Control.step);
+  failures += check_value (name, "chroma margin after the error", chromaMargin, Control.step);
+
+  /* the quiet period doubled: 8 error free frames */
+  numFrames = 0;
+
+  while (lumaMargin && check_now () < deadline)
+  {
+    check_feedDecoder (&device, &decSyncChan, &numFrames);
+
+    if (!xvfbsync_fakedev_getLastConfig (device.dev, 0, &config) && config.luma_margin == Control.step)
+      programmedRaised = true;
+
+    xvfbsync_decSyncChan_getMargins (&decSyncChan, &lumaMargin, &chromaMargin);
+  }
+
+  if (!programmedRaised)
+    failures += check_fail (name, "the raised margin wasn't programmed");
+
+  if (lumaMargin || chromaMargin)
+    failures += check_fail (name, "the margins didn't come back down");
+  else if (numFrames < 2 * Control.quietFrames || numFrames >= 2 * Control.quietFrames + XVSFSYNC_BUF_PER_CHANNEL)
+    failures += check_value (name, "error free frames before the decrease", numFrames, 2 * Control.quietFrames);
+
+  xvfbsync_decSyncChan_depopulate (&decSyncChan);
+  check_closeDevice (&device);
+  return failures;
+}
+
+struct CheckReserver
+{
+  struct SyncIp1* syncIP;
+  pthread_barrier_t* barrier;
+  int chanId;
+};
+
+static void* check_reserveRoutine (void* arg)
+{
+  struct CheckReserver* reserver = arg;
+
+  pthread_barrier_wait (reserver->barrier);
+  reserver->chanId = xvfbsync_syncIP_getFreeChannel (reserver->syncIP);
+  return NULL;
+}
+
+/* Threads racing for the channels each get a different one, and none gets
+ * the channel another process (a second sync ip on the same device) uses */
+static int check_freeChannels (const char* name)
+{
+  struct CheckDevice device;
+  struct SyncIp1 other;
+  struct SyncIpOptions1 options = { .eThreading = THREADING_NONE };
+  struct EncSyncChannel1 encSyncChan;
+  struct CheckReserver reservers[CHECK_RESERVING_THREADS];
+  pthread_t threads[CHECK_RESERVING_THREADS];
+  pthread_barrier_t barrier;
+  LLP2Buf* buf = check_createFrame (0);
+  int failures = 0;
+
+  /* the busy slot of the other process stays busy during the check */
+  if (check_openDevice (&device, true, 10000000000, 10000000000))
+    return 1;
+
+  if (xvfbsync_syncIP_populateWithOptions (&other, xvfbsync_fakedev_getFd (device.dev), &xvfbsync_fakedev_ops, device.dev, &options)) {
+    check_closeDevice (&device);
+    return check_fail (name, "couldn't open the device twice");
+  }
+
+  xvfbsync_encSyncChan_populate (&encSyncChan, &other, XVSFSYNC_MAX_ENC_CHANNEL - 1, CHECK_HORIZONTAL_ALIGNMENT, CHECK_VERTICAL_ALIGNMENT);
+  xvfbsync_encSyncChan_addBuffers (&encSyncChan, &buf, 1);
+  xvfbsync_encSyncChan_enable (&encSyncChan);
+
+  for (int round = 0; round < 50 && !failures; ++round)
+  {
+    uint32_t reserved = 0;
+    int numReserved = 0;
+
+    pthread_barrier_init (&barrier, NULL, CHECK_RESERVING_THREADS);
+
+    for (int i = 0; i < CHECK_RESERVING_THREADS; ++i)
+    {
+      reservers[i].syncIP = &device.syncIP;
+      reservers[i].barrier = &barrier;
+      pthread_create (&threads[i], NULL, &check_reserveRoutine, &reservers[i]);
+    }
+
+    for (int i = 0; i < CHECK_RESERVING_THREADS; ++i)
+    {
+      pthread_join (threads[i], NULL);
+
+      if (reservers[i].chanId == -1)
+        continue;
+
+      if (reserved & BIT(reservers[i].chanId))
+        failures += check_fail (name, "a channel was handed out twice");
+
+      reserved |= BIT(reservers[i].chanId);
+      ++numReserved;
+    }
+
+    pthread_barrier_destroy (&barrier);
+    failures += check_value (name, "reserved channels", reserved, BIT(XVSFSYNC_MAX_ENC_CHANNEL - 1) - 1);
+    failures += check_value (name, "reservations", numReserved, XVSFSYNC_MAX_ENC_CHANNEL - 1);
+
+    for (int chanId = 0; chanId < XVSFSYNC_MAX_ENC_CHANNEL; ++chanId)
+    {
+      if (reserved & BIT(chanId))
+        xvfbsync_syncIP_releaseChannel (&device.syncIP, chanId);
+    }
+  }
+
+  xvfbsync_encSyncChan_depopulate (&encSyncChan);
+  xvfbsync_syncIP_depopulate (&other);
+  check_closeDevice (&device);
+  return failures;
+}
+
+static const struct BehaviourCheck BehaviourChecks[] =
+{
+  { "recovery and backoff", check_recovery },
+  { "auto recycle", check_autoRecycle },
+  { "decoder slots", check_decoderTrackedSlots },
+  { "decoder slots, driver search", check_decoderSearchedSlots },
+  { "margin growth and decay", check_margins },
+  { "concurrent getFreeChannel", check_freeChannels },
+};
+
+int main (void)
+{
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof (CheckCases) / sizeof (CheckCases[0]); ++i)
+    failures += check_run (&CheckCases[i]);
+
+  for (size_t i = 0; i < sizeof (BehaviourChecks) / sizeof (BehaviourChecks[0]); ++i)
+  {
+    int checkFailures = BehaviourChecks[i].run (BehaviourChecks[i].name);
+
+    printf ("%-32s %s\n", BehaviourChecks[i].name, checkFailures ? "FAILED" : "ok");
+    failures += checkFailures;
+  }
+
+  return failures != 0;
+}
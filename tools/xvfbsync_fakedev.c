@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include "xvfbsync_fakedev.h"
+
+struct FakeSlot1
+{
+  bool busy;
+  bool done[XVSFSYNC_IO];
+  uint64_t programmedAt;
+};
+
+struct FakeChannel1
+{
+  bool enabled;
+  uint64_t enabledAt;
+  bool syncError;
+  bool hung; /* no progress until the channel is disabled */
+  struct FakeSlot1 slots[XVSFSYNC_BUF_PER_CHANNEL];
+  bool configured;
+  struct xvsfsync_chan_config lastConfig; /* last accepted SET_CHAN_CONFIG */
+};
+
+struct FakeSyncIp1
+{
+  struct FakeSyncIpConfig1 config;
+  int fd;
+  bool signaled; /* the eventfd counter is not zero */
+  bool quit;
+  pthread_t hardwareThread;
+  pthread_mutex_t mutex;
+  pthread_cond_t hardwareCond; /* wakes the hardware thread up */
+  pthread_cond_t slotFreed;
+  struct FakeChannel1 channels[XVSFSYNC_MAX_ENC_CHANNEL];
+  struct xvsfsync_fbdone fbdone; /* latched until CLR_CHAN_FBDONE_STAT */
+  _Atomic uint64_t numIoctls;
+};
+
+static uint64_t xvfbsync_fakedev_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Keep the eventfd readable exactly while something is pending (called locked) */
+static void xvfbsync_fakedev_updateSignal (struct FakeSyncIp1* dev)
+{
+  bool pending = false;
+
+  for (int channel = 0; channel < dev->config.maxChannels && !pending; ++channel)
+  {
+    pending = dev->channels[channel].syncError;
+
+    for (int buffer = 0; buffer < XVSFSYNC_BUF_PER_CHANNEL && !pending; ++buffer)
+    {
+      for (int user = 0; user < XVSFSYNC_IO; ++user)
+        pending = pending || dev->fbdone.status[channel][buffer][user];
+    }
+  }
+
+  uint64_t value = 1;
+
+  if (pending && !dev->signaled) {
+    if (write (dev->fd, &value, sizeof (value)) == sizeof (value))
+      dev->signaled = true;
+  } else if (!pending && dev->signaled) {
+    if (read (dev->fd, &value, sizeof (value)) == sizeof (value))
+      dev->signaled = false;
+  }
+}
+
+/* Complete the producers/consumers whose deadline passed and return the
+ * next deadline, 0 if there is none (called locked) */
+static uint64_t xvfbsync_fakedev_advance (struct FakeSyncIp1* dev, uint64_t now)
+{
+  const uint64_t delays[XVSFSYNC_IO] = { dev->config.producerDelayNs, dev->config.consumerDelayNs };
+  uint64_t next = 0;
+  bool freed = false;
+
+  for (int channel = 0; channel < dev->config.maxChannels; ++channel)
+  {
+    struct FakeChannel1* chan = &dev->channels[channel];
+
+    if (!chan->enabled || chan->hung)
+      continue;
+
+    for (int buffer = 0; buffer < XVSFSYNC_BUF_PER_CHANNEL; ++buffer)
+    {
+      struct FakeSlot1* slot = &chan->slots[buffer];
+
+      if (!slot->busy)
+        continue;
+
+      uint64_t start = slot->programmedAt > chan->enabledAt ? slot->programmedAt : chan->enabledAt;
+
+      for (int user = 0; user < XVSFSYNC_IO; ++user)
+      {
+        if (slot->done[user])
+          continue;
+
+        uint64_t deadline = start + delays[user];
+
+        if (deadline <= now) {
+          slot->done[user] = true;
+          dev->fbdone.status[channel][buffer][user] = 1;
+        } else if (!next || deadline < next)
+          next = deadline;
+      }
+
+      if (slot->done[XVSFSYNC_PROD] && slot->done[XVSFSYNC_CONS]) {
+        slot->busy = false;
+        freed = true;
+      }
+    }
+  }
+
+  if (freed)
+    pthread_cond_broadcast (&dev->slotFreed);
+
+  xvfbsync_fakedev_updateSignal (dev);
+  return next;
+}
+
+static void* xvfbsync_fakedev_hardwareRoutine (void* arg)
+{
+  struct FakeSyncIp1* dev = arg;
+
+  pthread_mutex_lock (&dev->mutex);
+
+  while (!dev->quit)
+  {
+    uint64_t next = xvfbsync_fakedev_advance (dev, xvfbsync_fakedev_now ());
+
+    if (!next) {
+      pthread_cond_wait (&dev->hardwareCond, &dev->mutex);
+      continue;
+    }
+
+    struct timespec deadline;
+    deadline.tv_sec = next / UINT64_C(1000000000);
+    deadline.tv_nsec = next % UINT64_C(1000000000);
+    pthread_cond_timedwait (&dev->hardwareCond, &dev->mutex, &deadline);
+  }
+
+  pthread_mutex_unlock (&dev->mutex);
+  return NULL;
+}
+
+static int xvfbsync_fakedev_setConfig (struct FakeSyncIp1* dev, struct xvsfsync_chan_config* config)
+{
+  if (config->channel_id >= dev->config.maxChannels)
+    return -EINVAL;
+
+  /* like the driver, a buffer has to end after it starts */
+  for (int user = 0; user < XVSFSYNC_IO; ++user)
+  {
+    if (config->luma_end_address[user] < config->luma_start_address[user] || config->chroma_end_address[user] < config->chroma_start_address[user])
+      return -EINVAL;
+  }
+
+  struct FakeChannel1* chan = &dev->channels[config->channel_id];
+  int fbId = config->fb_id[XVSFSYNC_PROD];
+
+  /* auto search takes the first free slot, like the driver */
+  if (fbId == XVSFSYNC_AUTO_SEARCH)
+  {
+    for (fbId = 0; fbId < XVSFSYNC_BUF_PER_CHANNEL && chan->slots[fbId].busy; ++fbId)
+      ;
+  }
+
+  if (fbId >= XVSFSYNC_BUF_PER_CHANNEL || chan->slots[fbId].busy)
+    return -EBUSY;
+
+  struct FakeSlot1* slot = &chan->slots[fbId];
+  slot->busy = true;
+  chan->configured = true;
+  chan->lastConfig = *config;
+  slot->programmedAt = xvfbsync_fakedev_now ();
+
+  for (int user = 0; user < XVSFSYNC_IO; ++user)
+  {
+    slot->done[user] = false;
+    dev->fbdone.status[config->channel_id][fbId][user] = 0;
+  }
+
+  pthread_cond_signal (&dev->hardwareCond);
+  return 0;
+}
+
+static void xvfbsync_fakedev_getStatus (struct FakeSyncIp1* dev, struct xvsfsync_stat* status)
+{
+  memset (status, 0, sizeof (*status));
+
+  for (int channel = 0; channel < dev->config.maxChannels; ++channel)
+  {
+    struct FakeChannel1* chan = &dev->channels[channel];
+
+    for (int buffer = 0; buffer < XVSFSYNC_BUF_PER_CHANNEL; ++buffer)
+    {
+      for (int user = 0; user < XVSFSYNC_IO; ++user)
+        status->fbdone[channel][buffer][user] = !chan->slots[buffer].busy || chan->slots[buffer].done[user];
+    }
+
+    status->enable[channel] = chan->enabled;
+    status->sync_err[channel] = chan->syncError;
+  }
+}
+
+static int xvfbsync_fakedev_ioctl (void* opaque, int fd, unsigned long request, void* arg)
+{
+  struct FakeSyncIp1* dev = opaque;
+  int ret = 0;
+
+  (void)fd;
+  atomic_fetch_add_explicit (&dev->numIoctls, 1, memory_order_relaxed);
+
+  if (dev->config.ioctlCostNs)
+  {
+    uint64_t end = xvfbsync_fakedev_now () + dev->config.ioctlCostNs;
+
+    while (xvfbsync_fakedev_now () < end)
+      ;
+  }
+
+  pthread_mutex_lock (&dev->mutex);
+
+  switch (request)
+  {
+  case XVSFSYNC_GET_CFG:
+  {
+    struct xvsfsync_config* config = arg;
+    config->encode = dev->config.encode;
+    config->max_channels = dev->config.maxChannels;
+    break;
+  }
+  case XVSFSYNC_GET_CHAN_STATUS:
+    xvfbsync_fakedev_getStatus (dev, arg);
+    break;
+  case XVSFSYNC_SET_CHAN_CONFIG:
+    ret = xvfbsync_fakedev_setConfig (dev, arg);
+    break;
+  case XVSFSYNC_CHAN_ENABLE:
+  case XVSFSYNC_CHAN_DISABLE:
+  {
+    int channel = (int)(uintptr_t)arg;
+
+    if (channel >= dev->config.maxChannels) {
+      ret = -EINVAL;
+      break;
+    }
+
+    struct FakeChannel1* chan = &dev->channels[channel];
+    chan->enabled = request == XVSFSYNC_CHAN_ENABLE;
+    chan->enabledAt = xvfbsync_fakedev_now ();
+
+    /* disabling a channel releases all its framebuffers */
+    if (!chan->enabled) {
+      chan->hung = false;
+      memset (chan->slots, 0, sizeof (chan->slots));
+      memset (dev->fbdone.status[channel], 0, sizeof (dev->fbdone.status[channel]));
+      pthread_cond_broadcast (&dev->slotFreed);
+    }
+
+    pthread_cond_signal (&dev->hardwareCond);
+    break;
+  }
+  case XVSFSYNC_CLR_CHAN_ERR:
+  {
+    struct xvsfsync_clr_err* clr = arg;
+
+    if (clr->channel_id < dev->config.maxChannels && clr->sync_err)
+      dev->channels[clr->channel_id].syncError = false;
+    break;
+  }
+  case XVSFSYNC_GET_CHAN_FBDONE_STAT:
+    memcpy (arg, &dev->fbdone, sizeof (dev->fbdone));
+    break;
+  case XVSFSYNC_CLR_CHAN_FBDONE_STAT:
+  {
+    struct xvsfsync_fbdone* clr = arg;
+
+    for (int channel = 0; channel < XVSFSYNC_MAX_ENC_CHANNEL; ++channel)
+    {
+      for (int buffer = 0; buffer < XVSFSYNC_BUF_PER_CHANNEL; ++buffer)
+      {
+        for (int user = 0; user < XVSFSYNC_IO; ++user)
+        {
+          if (clr->status[channel][buffer][user])
+            dev->fbdone.status[channel][buffer][user] = 0;
+        }
+      }
+    }
+    break;
+  }
+  case XVSFSYNC_GET_PHY_ADDR:
+  {
+    /* any file stands for a dmabuf, its inode gives a stable fake address */
+    struct xvsfsync_dma_info* info = arg;
+    struct stat st;
+
+    if (fstat ((int)info->fd, &st))
+      ret = -EBADF;
+    else
+      info->phy_addr = 0x80000000 | (uint32_t)((st.st_ino & 0x7ff) << 20);
+    break;
+  }
+  default:
+    ret = -ENOTTY;
+    break;
+  }
+
+  xvfbsync_fakedev_updateSignal (dev);
+  pthread_mutex_unlock (&dev->mutex);
+
+  if (ret) {
+    errno = -ret;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* The eventfd only says something is pending, report it the way the driver
+ * does: POLLIN for framebuffer done bits, POLLPRI for errors */
+static int xvfbsync_fakedev_poll (void* opaque, struct pollfd* fds, nfds_t nfds, int timeout)
+{
+  struct FakeSyncIp1* dev = opaque;
+  short events[nfds];
+
+  for (nfds_t i = 0; i < nfds; ++i)
+  {
+    events[i] = fds[i].events;
+
+    if (fds[i].fd == dev->fd)
+      fds[i].events = POLLIN;
+  }
+
+  int ret = poll (fds, nfds, timeout);
+
+  if (ret <= 0) {
+    for (nfds_t i = 0; i < nfds; ++i)
+      fds[i].events = events[i];
+    return ret;
+  }
+
+  ret = 0;
+  pthread_mutex_lock (&dev->mutex);
+
+  for (nfds_t i = 0; i < nfds; ++i)
+  {
+    fds[i].events = events[i];
+
+    if (fds[i].fd == dev->fd && (fds[i].revents & POLLIN))
+    {
+      bool fbdone = false;
+      bool error = false;
+
+      for (int channel = 0; channel < dev->config.maxChannels; ++channel)
+      {
+        error = error || dev->channels[channel].syncError;
+
+        for (int buffer = 0; buffer < XVSFSYNC_BUF_PER_CHANNEL; ++buffer)
+        {
+          for (int user = 0; user < XVSFSYNC_IO; ++user)
+            fbdone = fbdone || dev->fbdone.status[channel][buffer][user];
+        }
+      }
+
+      fds[i].revents = ((fbdone ? POLLIN : 0) | (error ? POLLPRI : 0)) & events[i];
+    }
+
+    if (fds[i].revents)
+      ++ret;
+  }
+
+  pthread_mutex_unlock (&dev->mutex);
+  return ret;
+}
+
+const struct SyncIpDeviceOps1 xvfbsync_fakedev_ops =
+{
+  .ioctl = &xvfbsync_fakedev_ioctl,
+  .poll = &xvfbsync_fakedev_poll,
+};
+
+struct FakeSyncIp1* xvfbsync_fakedev_create (const struct FakeSyncIpConfig1* config)
+{
+  struct FakeSyncIp1* dev = calloc (1, sizeof (struct FakeSyncIp1));
+
+  if (!dev)
+    return NULL;
+
+  dev->config = *config;
+
+  if (dev->config.maxChannels > XVSFSYNC_MAX_ENC_CHANNEL)
+    dev->config.maxChannels = XVSFSYNC_MAX_ENC_CHANNEL;
+
+  dev->fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if (dev->fd == -1) {
+    free (dev);
+    return NULL;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init (&dev->mutex, NULL);
+  pthread_cond_init (&dev->hardwareCond, &attr);
+  pthread_cond_init (&dev->slotFreed, NULL);
+  pthread_condattr_destroy (&attr);
+
+  if (pthread_create (&dev->hardwareThread, NULL, &xvfbsync_fakedev_hardwareRoutine, dev)) {
+    close (dev->fd);
+    free (dev);
+    return NULL;
+  }
+
+  return dev;
+}
+
+void xvfbsync_fakedev_destroy (struct FakeSyncIp1* dev)
+{
+  pthread_mutex_lock (&dev->mutex);
+  dev->quit = true;
+  pthread_cond_signal (&dev->hardwareCond);
+  pthread_mutex_unlock (&dev->mutex);
+  pthread_join (dev->hardwareThread, NULL);
+  pthread_cond_destroy (&dev->hardwareCond);
+  pthread_cond_destroy (&dev->slotFreed);
+  pthread_mutex_destroy (&dev->mutex);
+  close (dev->fd);
+  free (dev);
+}
+
+int xvfbsync_fakedev_getFd (struct FakeSyncIp1* dev)
+{
+  return dev->fd;
+}
+
+void xvfbsync_fakedev_waitFreeSlot (struct FakeSyncIp1* dev, int chanId)
+{
+  pthread_mutex_lock (&dev->mutex);
+
+  for (;;)
+  {
+    bool isFree = false;
+
+    for (int buffer = 0; buffer < XVSFSYNC_BUF_PER_CHANNEL; ++buffer)
+      isFree = isFree || !dev->channels[chanId].slots[buffer].busy;
+
+    if (isFree || dev->quit)
+      break;
+
+    pthread_cond_wait (&dev->slotFreed, &dev->mutex);
+  }
+
+  pthread_mutex_unlock (&dev->mutex);
+}
+
+void xvfbsync_fakedev_injectError (struct FakeSyncIp1* dev, int chanId)
+{
+  pthread_mutex_lock (&dev->mutex);
+  dev->channels[chanId].syncError = true;
+  dev->channels[chanId].hung = true;
+  xvfbsync_fakedev_updateSignal (dev);
+  pthread_mutex_unlock (&dev->mutex);
+}
+
+int xvfbsync_fakedev_getLastConfig (struct FakeSyncIp1* dev, int chanId, struct xvsfsync_chan_config* config)
+{
+  pthread_mutex_lock (&dev->mutex);
+  bool configured = dev->channels[chanId].configured;
+
+  if (configured)
+    *config = dev->channels[chanId].lastConfig;
+
+  pthread_mutex_unlock (&dev->mutex);
+  return configured ? 0 : -1;
+}
+
+uint64_t xvfbsync_fakedev_getIoctlCount (struct FakeSyncIp1* dev)
+{
+  return atomic_load_explicit (&dev->numIoctls, memory_order_relaxed);
+}
@@ -0,0 +1,44 @@
+/*
+ * In-process stand-in for the xvsfsync driver.
+ *
+ * It implements the ioctls used by the library on top of a software model of
+ * the sync ip: each channel has XVSFSYNC_BUF_PER_CHANNEL framebuffer slots,
+ * the producer and the consumer of a programmed slot are reported done after
+ * a configurable delay. The device fd is an eventfd, made readable while
+ * framebuffer done bits or errors are pending, like the driver does for
+ * POLLIN/POLLPRI. Any file can be resolved as a dmabuf, its inode gives its
+ * physical address.
+ */
+
+#ifndef __XVFBSYNC_FAKEDEV_H__
+#define __XVFBSYNC_FAKEDEV_H__
+
+#include "xvfbsync.h"
+
+struct FakeSyncIpConfig1
+{
+  bool encode;
+  int maxChannels; /* up to XVSFSYNC_MAX_ENC_CHANNEL */
+  uint64_t producerDelayNs; /* programmed (or enabled) -> producer done */
+  uint64_t consumerDelayNs; /* programmed (or enabled) -> consumer done */
+  uint64_t ioctlCostNs; /* busy wait added to every ioctl */
+};
+
+struct FakeSyncIp1;
+
+extern const struct SyncIpDeviceOps1 xvfbsync_fakedev_ops;
+
+struct FakeSyncIp1* xvfbsync_fakedev_create (const struct FakeSyncIpConfig1* config);
+void xvfbsync_fakedev_destroy (struct FakeSyncIp1* dev);
+/* fd to give to xvfbsync_syncIP_populateWithOps with the fake ops and dev */
+int xvfbsync_fakedev_getFd (struct FakeSyncIp1* dev);
+/* Block until chanId has a free framebuffer slot */
+void xvfbsync_fakedev_waitFreeSlot (struct FakeSyncIp1* dev, int chanId);
+/* Raise a sync error on chanId (reported through POLLPRI), the channel
+ * then stops completing its framebuffers until it is disabled */
+void xvfbsync_fakedev_injectError (struct FakeSyncIp1* dev, int chanId);
+/* Last config programmed on chanId, -1 if there is none */
+int xvfbsync_fakedev_getLastConfig (struct FakeSyncIp1* dev, int chanId, struct xvsfsync_chan_config* config);
+uint64_t xvfbsync_fakedev_getIoctlCount (struct FakeSyncIp1* dev);
+
+#endif
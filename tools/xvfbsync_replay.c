@@ -0,0 +1,130 @@
+/*
+ * Replays an ioctl recording (xvfbsync_syncIP_startRecording) through the
+ * library against the in-process fake sync ip (tools/xvfbsync_fakedev.c),
+ * so a field capture can be reproduced without a board.
+ *
+ * usage: xvfbsync_replay [-s speed] [-p producer_us] [-c consumer_us]
+ *                        [-k ioctl_cost_ns] recording
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "xvfbsync_fakedev.h"
+
+static uint64_t replay_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int replay_readHeader (const char* path, struct RecordHeader1* header)
+{
+  FILE* file = fopen (path, "rb");
+
+  if (!file) {
+    fprintf (stderr, "Couldn't open %s\n", path);
+    return -1;
+  }
+
+  int ret = fread (header, sizeof (*header), 1, file) == 1 && header->magic == XVFBSYNC_RECORD_MAGIC ? 0 : -1;
+  fclose (file);
+
+  if (ret)
+    fprintf (stderr, "%s isn't an ioctl recording\n", path);
+
+  return ret;
+}
+
+static void replay_report (struct SyncIp1* syncIP)
+{
+  const struct StatsSegment1* stats = xvfbsync_syncIP_getStats (syncIP);
+
+  if (!stats)
+    return;
+
+  printf ("%-8s %10s %10s %14s\n", "channel", "ioctls", "failures", "driver time");
+  printf ("%-8s %10" PRIu64 " %10" PRIu64 " %12" PRIu64 "us\n", "device", stats->device.ioctls, stats->device.ioctlFailures, stats->device.ioctlTimeNs / 1000);
+
+  for (uint32_t i = 0; i < stats->numChannels; ++i)
+  {
+    const struct StatsCounters1* counters = &stats->channels[i];
+    printf ("%-8u %10" PRIu64 " %10" PRIu64 " %12" PRIu64 "us\n", i, counters->ioctls, counters->ioctlFailures, counters->ioctlTimeNs / 1000);
+  }
+}
+
+static void replay_usage (const char* name)
+{
+  fprintf (stderr, "usage: %s [-s speed] [-p producer_us] [-c consumer_us] [-k ioctl_cost_ns] recording\n", name);
+}
+
+int main (int argc, char** argv)
+{
+  struct FakeSyncIpConfig1 device;
+  double speed = 1.0;
+  int opt;
+
+  memset (&device, 0, sizeof (device));
+  device.producerDelayNs = 20000;
+  device.consumerDelayNs = 40000;
+
+  while ((opt = getopt (argc, argv, "s:p:c:k:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 's': speed = atof (optarg); break;
+    case 'p': device.producerDelayNs = strtoull (optarg, NULL, 0) * 1000; break;
+    case 'c': device.consumerDelayNs = strtoull (optarg, NULL, 0) * 1000; break;
+    case 'k': device.ioctlCostNs = strtoull (optarg, NULL, 0); break;
+    default: replay_usage (argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind != argc - 1 || speed < 0) {
+    replay_usage (argv[0]);
+    return 1;
+  }
+
+  struct RecordHeader1 header;
+
+  if (replay_readHeader (argv[optind], &header))
+    return 1;
+
+  device.encode = header.encode;
+  device.maxChannels = header.maxChannels;
+
+  struct FakeSyncIp1* dev = xvfbsync_fakedev_create (&device);
+
+  if (!dev) {
+    fprintf (stderr, "Couldn't create the fake sync ip\n");
+    return 1;
+  }
+
+  /* no event handling, the recording holds its ioctls */
+  struct SyncIpOptions1 options = { .eThreading = THREADING_NONE };
+  struct SyncIp1 syncIP;
+
+  if (xvfbsync_syncIP_populateWithOptions (&syncIP, xvfbsync_fakedev_getFd (dev), &xvfbsync_fakedev_ops, dev, &options)) {
+    fprintf (stderr, "Couldn't populate the sync ip\n");
+    xvfbsync_fakedev_destroy (dev);
+    return 1;
+  }
+
+  printf ("%s: %s, %u channels, speed: %gx\n", argv[optind], header.encode ? "encode" : "decode", header.maxChannels, speed);
+
+  uint64_t start = replay_now ();
+  int mismatches = xvfbsync_syncIP_replay (&syncIP, argv[optind], speed);
+  double elapsed = (replay_now () - start) / 1e6;
+
+  if (mismatches >= 0) {
+    printf ("replayed in %.3fms, %d ioctls returned another result than recorded\n", elapsed, mismatches);
+    replay_report (&syncIP);
+  }
+
+  xvfbsync_syncIP_depopulate (&syncIP);
+  xvfbsync_fakedev_destroy (dev);
+  return mismatches < 0;
+}
@@ -25,33 +25,86 @@
 *
 */
 
+#define _GNU_SOURCE /* memfd_create */
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 #include "xvfbsync.h"
 
 #define MIN(a,b) ((a) < (b) ? a : b)
 
+/* Internal event, handed to the event handler of a channel when its
+ * deferred restart or buffer programming is due. It is never notified to
+ * the application */
+#define XVFBSYNC_EVENT_RETRY BIT(14)
+/* Tags the epoll key of the retry eventfd of a managed device */
+#define XVFBSYNC_MANAGER_RETRY_KEY (1ull << 63)
+/* Internal event, a producer or consumer finished a framebuffer of the
+ * channel, even in a slot the driver picked itself */
+#define XVFBSYNC_EVENT_PROGRESS BIT(15)
+
+/* Build with -DXVFBSYNC_NO_PRINT to remove the stdio calls from the library,
+ * the trace ring still records what happened. The arguments are still
+ * type-checked and count as used */
+#ifdef XVFBSYNC_NO_PRINT
+#define xvfbsync_print(...) do { if (0) printf (__VA_ARGS__); } while (0)
+#else
+#define xvfbsync_print(...) printf (__VA_ARGS__)
+#endif
+
 /* ************** */
 /* xvfbsync queue */
 /* ************** */
 
-static void xvfbsync_queue_init (struct Queue* q) 
+/* The queue is a ring of preallocated slots whose capacity is always a power
+ * of two, so indexes wrap with a mask. It only allocates when it grows, which
+ * happens while the buffers are registered, never while frames are processed */
+
+static int xvfbsync_queue_init (struct Queue* q, unsigned int capacity)
+{
+  if(!q)
+    return -1;
+
+  assert (capacity && !(capacity & (capacity - 1)));
+  q->entries = (struct QueueEntry*) calloc (capacity, sizeof (struct QueueEntry));
+  q->capacity = q->entries ? capacity : 0;
+  q->head = 0;
+  q->size = 0;
+  return q->entries ? 0 : -1;
+}
+
+static void xvfbsync_queue_deinit (struct Queue* q)
 {
   if(!q)
     return;
 
-  q->front = NULL;
-  q->last = NULL;
+  free (q->entries);
+  q->entries = NULL;
+  q->capacity = 0;
+  q->head = 0;
   q->size = 0;
 }
 
-static LLP2Buf* xvfbsync_queue_front (struct Queue* q) 
+static struct QueueEntry* xvfbsync_queue_front (struct Queue* q) 
 {
-  if (!q)
+  if (!q || q->size == 0)
     return NULL;
 
-  return q->front->buf;
+  return &q->entries[q->head];
 }
 
 static void xvfbsync_queue_pop (struct Queue* q) 
@@ -60,701 +113,3657 @@ static void xvfbsync_queue_pop (struct Queue* q)
     return;
 
   q->size--;
-
-  struct Node* temp = q->front;
-  q->front = q->front->next;
-  free(temp);
+  q->entries[q->head].buf = NULL;
+  q->entries[q->head].desc = NULL;
+  q->entries[q->head].configValid = false;
+  q->head = (q->head + 1) & (q->capacity - 1);
 }
 
-static void xvfbsync_queue_push (struct Queue* q, LLP2Buf* bufptr)
+static int xvfbsync_queue_grow (struct Queue* q)
 {
-  if (!q)
-    return;
+  unsigned int capacity = q->capacity * 2;
+  struct QueueEntry* entries = (struct QueueEntry*) calloc (capacity, sizeof (struct QueueEntry));
 
-  q->size++;
+  if (!entries)
+    return -1;
 
-  if (q->front == NULL) {
-    q->front = (struct Node*) calloc (1, sizeof (struct Node));
-    q->front->buf = bufptr;
-    q->front->next = NULL;
-    q->last = q->front;
-  } else {
-    q->last->next = (struct Node*) calloc (1, sizeof (struct Node));
-    q->last->next->buf = bufptr;
-    q->last->next->next = NULL;
-    q->last = q->last->next;
-  }
+  /* unwrap the ring so the front lands on the first slot */
+  for (unsigned int i = 0; i < q->size; ++i)
+    entries[i] = q->entries[(q->head + i) & (q->capacity - 1)];
+
+  free (q->entries);
+  q->entries = entries;
+  q->capacity = capacity;
+  q->head = 0;
+  return 0;
 }
 
-static int xvfbsync_queue_empty (struct Queue* q) 
+/* Grow until count more entries fit, so a batch can't fail halfway */
+static int xvfbsync_queue_reserve (struct Queue* q, int count)
 {
-  if (!q)
+  if (count < 0)
     return -1;
 
-  return q->size == 0;
-}
+  while (q->capacity - q->size < (unsigned int)count)
+  {
+    if (xvfbsync_queue_grow (q))
+      return -1;
+  }
 
-/* *********************** */
-/* xvfbsync syncIP helpers */
-/* *********************** */
+  return 0;
+}
 
-static void parseChanStatus (struct xvsfsync_stat* status, 
-  struct ChannelStatus1* channelStatuses, int maxChannels, 
-  int maxUsers, int maxBuffers)
+/* Returns the new back entry so the caller can fill its cached config */
+static struct QueueEntry* xvfbsync_queue_push (struct Queue* q, LLP2Buf* bufptr, const TFormatDesc* desc)
 {
-  for (int channel = 0; channel < maxChannels; ++channel)
-  {
-    struct ChannelStatus1* channelStatus = &(channelStatuses[channel]);
+  if (!q)
+    return NULL;
 
-    for (int buffer = 0; buffer < maxBuffers; ++buffer)
-    {
-      for (int user = 0; user < maxUsers; ++user)
-        channelStatus->fbAvail[buffer][user] = status->fbdone[channel][buffer][user];
-    }
+  if (q->size == q->capacity && xvfbsync_queue_grow (q))
+    return NULL;
 
-    channelStatus->enable = status->enable[channel];
-    channelStatus->syncError = status->sync_err[channel];
-    channelStatus->watchdogError = status->wdg_err[channel];
-    channelStatus->lumaDiffError = status->ldiff_err[channel];
-    channelStatus->chromaDiffError = status->cdiff_err[channel];
-  }
+  struct QueueEntry* entry = &q->entries[(q->head + q->size) & (q->capacity - 1)];
+  entry->buf = bufptr;
+  entry->desc = desc;
+  entry->configValid = false;
+  entry->fbId = -1;
+  entry->completedAt = 0;
+  q->size++;
+  return entry;
 }
 
-static void xvfbsync_syncIP_getLatestChanStatus(struct SyncIp1* syncIP)
+/* Move the front buffer to the back of the queue without any allocation */
+static void xvfbsync_queue_rotate (struct Queue* q)
 {
-  struct xvsfsync_stat chan_status;
+  if(!q || q->size == 0)
+    return;
 
-  if (ioctl (syncIP->fd, XVSFSYNC_GET_CHAN_STATUS, &chan_status))
-    printf ("Couldn't get sync ip channel status");
-  parseChanStatus (&chan_status, syncIP->channelStatuses, 
-    syncIP->maxChannels, syncIP->maxUsers, syncIP->maxBuffers);
+  q->entries[(q->head + q->size) & (q->capacity - 1)] = q->entries[q->head];
+  q->head = (q->head + 1) & (q->capacity - 1);
 }
 
-static void xvfbsync_syncIP_resetStatus(struct SyncIp1* syncIP, int chanId)
+static int xvfbsync_queue_empty (struct Queue* q) 
 {
-  struct xvsfsync_clr_err clr;
-  clr.channel_id = chanId;
-  clr.sync_err = 1;
-  clr.wdg_err = 1;
-  clr.ldiff_err = 1;
-  clr.cdiff_err = 1;
+  if (!q)
+    return -1;
 
-  if (ioctl (syncIP->fd, XVSFSYNC_CLR_CHAN_ERR, &clr))
-    printf ("Couldnt reset status of channel %d", chanId);
+  return q->size == 0;
 }
 
-static void xvfbsync_syncIP_enableChannel(struct SyncIp1* syncIP, int chanId)
-{
-  u8 chan = chanId;
+/* ************** */
+/* xvfbsync trace */
+/* ************** */
 
-  if (ioctl (syncIP->fd, XVSFSYNC_CHAN_ENABLE, (void*)(uintptr_t)chan))
-    printf ("Couldn't enable channel %d\n", chanId);
+static uint64_t xvfbsync_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
 }
 
-static void xvfbsync_syncIP_disableChannel(struct SyncIp1* syncIP, int chanId)
+/* Any thread can record an event without taking a lock: a slot is claimed
+ * by bumping traceHead and its sequence number is odd while it is written.
+ * Readers only keep the slots whose sequence number is stable and matches
+ * the index they expect */
+static void xvfbsync_trace_record (struct SyncIp1* syncIP, ETraceEvent type, int chanId, uint32_t arg, int32_t result, uint32_t duration)
 {
-  u8 chan = chanId;
+  if (!syncIP->traceSlots)
+    return;
+
+  uint64_t idx = atomic_fetch_add_explicit (&syncIP->traceHead, 1, memory_order_relaxed);
+  struct TraceSlot1* slot = &syncIP->traceSlots[idx & (XVFBSYNC_TRACE_SIZE - 1)];
 
-  if (ioctl (syncIP->fd, XVSFSYNC_CHAN_DISABLE, (void*)(uintptr_t)chan))
-    printf ("Couldn't disable channel %d\n", chanId);
+  atomic_store_explicit (&slot->seq, 2 * idx + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  atomic_store_explicit (&slot->timestamp, xvfbsync_now (), memory_order_relaxed);
+  atomic_store_explicit (&slot->argResult, ((uint64_t)arg << 32) | (uint32_t)result, memory_order_relaxed);
+  atomic_store_explicit (&slot->durationTypeChannel, ((uint64_t)duration << 32) | ((uint32_t)type << 16) | (uint16_t)chanId, memory_order_relaxed);
+  atomic_store_explicit (&slot->seq, 2 * idx + 2, memory_order_release);
 }
 
-static void xvfbsync_syncIP_addBuffer(struct SyncIp1* syncIP, struct xvsfsync_chan_config* fbConfig)
+static const char* xvfbsync_trace_eventName (uint16_t type)
 {
-  if (ioctl (syncIP->fd, XVSFSYNC_SET_CHAN_CONFIG, fbConfig))
-    printf ("Couldn't add buffer");
+  switch (type)
+  {
+  case TRACE_BUFFER_PROGRAMMED: return "buffer";
+  case TRACE_CHANNEL_ENABLE: return "enable";
+  case TRACE_CHANNEL_DISABLE: return "disable";
+  case TRACE_STATUS_FETCH: return "status";
+  case TRACE_ERROR: return "error";
+  case TRACE_IOCTL: return "ioctl";
+  default: return "unknown";
+  }
 }
 
-static void xvfbsync_syncIP_pollErrors(struct SyncIp1* syncIP, int timeout)
+/* ************** */
+/* xvfbsync stats */
+/* ************** */
+
+/* The counters live in a sealed memfd that other processes can map, each
+ * update is a single relaxed atomic add. Without the segment the sync ip
+ * works the same, it just doesn't count */
+static void xvfbsync_stats_init (struct SyncIp1* syncIP)
 {
-  /*
-  AL_EDriverError retCode = ioctl (syncIP->fd, AL_POLL_MSG, &timeout);
+  size_t size = offsetof (struct StatsSegment1, channels) + syncIP->maxChannels * sizeof (struct StatsCounters1);
 
-  if (retCode == DRIVER_TIMEOUT)
-    return;
+  syncIP->stats = NULL;
+  syncIP->statsSize = size;
+  syncIP->statsFd = memfd_create ("xvfbsync-stats", MFD_CLOEXEC | MFD_ALLOW_SEALING);
 
-  if (retCode != DRIVER_SUCCESS)
-    printf ("Error while polling the errors. (driver error: %d)\n", retCode);
+  if (syncIP->statsFd == -1) {
+    xvfbsync_print ("Couldn't create the statistics segment (errno: %d)\n", errno);
+    return;
+  }
 
-  pthread_mutex_lock (&(syncIP->mutex));
-  xvfbsync_syncIP_getLatestChanStatus (syncIP);
+  /* readers can rely on the size */
+  if (ftruncate (syncIP->statsFd, size) || fcntl (syncIP->statsFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+    xvfbsync_print ("Couldn't size the statistics segment (errno: %d)\n", errno);
+    goto fail;
+  }
 
-  for (size_t i = 0; i < syncIP->maxChannels; ++i)
-  {
-    struct ChannelStatus1* status = &(syncIP->channelStatuses[i]);
+  void* segment = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, syncIP->statsFd, 0);
 
-    if(syncIP->eventListeners[i] && (status->syncError || status->watchdogError || 
-      status->lumaDiffError || status->chromaDiffError))
-    {
-      syncIP->eventListeners[i] (status);
-      xvfbsync_syncIP_resetStatus(syncIP, i);
-    }
+  if (segment == MAP_FAILED) {
+    xvfbsync_print ("Couldn't map the statistics segment (errno: %d)\n", errno);
+    goto fail;
   }
 
-  pthread_mutex_unlock (&(syncIP->mutex));*/
+  /* the memfd starts zeroed, so are the counters */
+  syncIP->stats = segment;
+  syncIP->stats->version = XVFBSYNC_STATS_VERSION;
+  syncIP->stats->headerSize = offsetof (struct StatsSegment1, channels);
+  syncIP->stats->countersSize = sizeof (struct StatsCounters1);
+  syncIP->stats->numChannels = syncIP->maxChannels;
+  syncIP->stats->encode = syncIP->encode;
+  syncIP->stats->createdAt = xvfbsync_now ();
+  atomic_store_explicit (&syncIP->stats->magic, XVFBSYNC_STATS_MAGIC, memory_order_release);
   return;
+
+fail:
+  close (syncIP->statsFd);
+  syncIP->statsFd = -1;
 }
 
-static void* xvfbsync_syncIP_pollingRoutine(void* arg)
+static void xvfbsync_stats_deinit (struct SyncIp1* syncIP)
 {
-  struct SyncIp1* syncIP = ((struct ThreadInfo*)arg)->syncIP;
+  if (syncIP->stats)
+    munmap (syncIP->stats, syncIP->statsSize);
 
-  while(true)
-  {
-    pthread_mutex_lock (&(syncIP->mutex));
-    if(syncIP->quit) {
-      break;
-    }
-    pthread_mutex_unlock (&(syncIP->mutex));
-    xvfbsync_syncIP_pollErrors(syncIP, 5000);
-  }
-  pthread_mutex_unlock (&(syncIP->mutex));
-  xvfbsync_syncIP_pollErrors(syncIP, 0);
-  free ((struct ThreadInfo*)arg);
-  return NULL;
-}
+  if (syncIP->statsFd != -1)
+    close (syncIP->statsFd);
 
-static void xvfbsync_syncIP_addListener(struct SyncIp1* syncIP, int chanId, void (*delegate)(struct ChannelStatus1*))
-{
-  pthread_mutex_lock (&(syncIP->mutex));
-  syncIP->eventListeners[chanId] = delegate;
-  pthread_mutex_unlock (&(syncIP->mutex));
+  syncIP->stats = NULL;
+  syncIP->statsFd = -1;
 }
 
-static void xvfbsync_syncIP_removeListener(struct SyncIp1* syncIP, int chanId)
+/* Counters of channel chanId, of the device if chanId is -1, NULL if there
+ * is no segment */
+static struct StatsCounters1* xvfbsync_stats_counters (struct SyncIp1* syncIP, int chanId)
 {
-  pthread_mutex_lock (&(syncIP->mutex));
-  syncIP->eventListeners[chanId] = NULL;
-  pthread_mutex_unlock (&(syncIP->mutex));
+  if (!syncIP->stats)
+    return NULL;
+
+  if (chanId < 0 || chanId >= syncIP->maxChannels)
+    return &syncIP->stats->device;
+
+  return &syncIP->stats->channels[chanId];
 }
 
-static struct ChannelStatus1* xvfbsync_syncIP_getStatus(struct SyncIp1* syncIP, int chanId)
-{ 
-  pthread_mutex_lock (&(syncIP->mutex));
-  xvfbsync_syncIP_getLatestChanStatus(syncIP);
-  pthread_mutex_unlock (&(syncIP->mutex));
-  return &(syncIP->channelStatuses[chanId]);
+static void xvfbsync_stats_add (_Atomic uint64_t* counter, uint64_t value)
+{
+  atomic_fetch_add_explicit (counter, value, memory_order_relaxed);
 }
 
 /* *************** */
-/* xvfbsync syncIP */
+/* xvfbsync record */
 /* *************** */
 
-int xvfbsync_syncIP_getFreeChannel(struct SyncIp1* syncIP)
+/* Size of the struct the ioctl argument points to, 0 when the argument is
+ * passed by value */
+static uint32_t xvfbsync_record_argSize (unsigned long request)
 {
-  pthread_mutex_lock (&(syncIP->mutex));
-  xvfbsync_syncIP_getLatestChanStatus(syncIP);
-
-  /* TODO(driver lowlat2 xilinx) give a non racy way to choose a free channel
-   * For now we look if all the framebuffer of a channel are available to
-   * decide if a channel is free or not
-   */
-  for(int channel = 0; channel < syncIP->maxChannels; ++channel)
+  switch (request)
   {
-    bool isAvailable = true;
+  case XVSFSYNC_GET_CFG: return sizeof (struct xvsfsync_config);
+  case XVSFSYNC_GET_CHAN_STATUS: return sizeof (struct xvsfsync_stat);
+  case XVSFSYNC_SET_CHAN_CONFIG: return sizeof (struct xvsfsync_chan_config);
+  case XVSFSYNC_CLR_CHAN_ERR: return sizeof (struct xvsfsync_clr_err);
+  case XVSFSYNC_GET_CHAN_FBDONE_STAT: return sizeof (struct xvsfsync_fbdone);
+  case XVSFSYNC_CLR_CHAN_FBDONE_STAT: return sizeof (struct xvsfsync_fbdone);
+  case XVSFSYNC_GET_PHY_ADDR: return sizeof (struct xvsfsync_dma_info);
+  default: return 0;
+  }
+}
 
-    for(int buffer = 0; buffer < syncIP->maxBuffers; ++buffer)
-    {
-      for(int user = 0; user < syncIP->maxUsers; ++user)
-        isAvailable = isAvailable && syncIP->channelStatuses[channel].fbAvail[buffer][user];
-    }
+/* Append an ioctl to the recording, a failed write stops it */
+static void xvfbsync_record_write (struct SyncIp1* syncIP, int chanId, unsigned long request, void* arg, int ret, uint64_t start, uint64_t duration)
+{
+  struct RecordEntry1 entry;
+
+  memset (&entry, 0, sizeof (entry));
+  entry.request = request;
+  entry.result = ret;
+  entry.chanId = chanId;
+  entry.duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+  entry.argSize = xvfbsync_record_argSize (request);
+  entry.argValue = entry.argSize ? 0 : (uint64_t)(uintptr_t)arg;
 
-    if(isAvailable) {
-      pthread_mutex_unlock (&(syncIP->mutex));
-      return channel;
+  pthread_mutex_lock (&syncIP->recordMutex);
+
+  if (syncIP->recordFile)
+  {
+    entry.timestamp = start > syncIP->recordStart ? start - syncIP->recordStart : 0;
+
+    if (fwrite (&entry, sizeof (entry), 1, syncIP->recordFile) != 1 ||
+      (entry.argSize && fwrite (arg, entry.argSize, 1, syncIP->recordFile) != 1)) {
+      xvfbsync_print ("Couldn't write the ioctl recording, stop recording\n");
+      fclose (syncIP->recordFile);
+      syncIP->recordFile = NULL;
+      atomic_store_explicit (&syncIP->recording, false, memory_order_relaxed);
     }
   }
 
-  pthread_mutex_unlock (&(syncIP->mutex));
-  printf ("No channel available");
-  return -1;
+  pthread_mutex_unlock (&syncIP->recordMutex);
 }
 
-int xvfbsync_syncIP_populate (struct SyncIp1* syncIP, int fd)
+/* **************** */
+/* xvfbsync latency */
+/* **************** */
+
+/* Log-linear buckets: values below 2^HISTOGRAM_SUB_BITS have their own
+ * bucket, above that every power of two is split in 2^HISTOGRAM_SUB_BITS
+ * buckets, which keeps the relative error under 12.5% */
+static int xvfbsync_histogram_bucket (uint64_t value)
 {
-  struct ThreadInfo* tInfo = calloc (1, sizeof(struct ThreadInfo));
-  tInfo->syncIP = syncIP;
-  syncIP->quit = false;
-  syncIP->fd = fd;
+  const int subBuckets = 1 << XVFBSYNC_HISTOGRAM_SUB_BITS;
 
-  if (syncIP->fd == -1) {
-    printf ("Couldn't open the sync ip\n");
-    return -1;
-  }
+  if (value >= (UINT64_C(1) << XVFBSYNC_HISTOGRAM_MAX_BITS))
+    value = (UINT64_C(1) << XVFBSYNC_HISTOGRAM_MAX_BITS) - 1;
 
-  struct xvsfsync_config config;
-  
-  if (ioctl (syncIP->fd, XVSFSYNC_GET_CFG, &config)) {
-    printf ("Couldn't get sync ip configuration\n");
-    return -1;
-  }
+  if (value < (uint64_t)subBuckets)
+    return (int)value;
 
-  printf ("[fd: %d] mode: %s, channel number: %d\n", syncIP->fd, 
-    config.encode ? "encode" : "decode", config.max_channels);
-  syncIP->maxChannels = config.max_channels;
-  syncIP->maxUsers = XVSFSYNC_IO;
-  syncIP->maxBuffers = XVSFSYNC_BUF_PER_CHANNEL;
-  syncIP->maxCores = XVSFSYNC_MAX_CORES;
-  syncIP->channelStatuses = calloc (config.max_channels, sizeof (void*));
-  syncIP->eventListeners = calloc (config.max_channels, sizeof (void*));
+  int msb = 63 - __builtin_clzll (value);
+  int shift = msb - XVFBSYNC_HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << XVFBSYNC_HISTOGRAM_SUB_BITS) + (int)((value >> shift) & (subBuckets - 1));
+}
 
-  if (pthread_mutex_init (&(syncIP->mutex), NULL)) {
-    printf ("Couldn't intialize lock");
-    return -1;
-  }
+/* Returns the largest value stored in the bucket */
+static uint64_t xvfbsync_histogram_bucketMax (int bucket)
+{
+  const int subBuckets = 1 << XVFBSYNC_HISTOGRAM_SUB_BITS;
 
-  if (pthread_create (&(syncIP->pollingThread), NULL, &xvfbsync_syncIP_pollingRoutine, tInfo)) {
-    printf ("Couldn't create thread");
-    return -1;
-  }
+  if (bucket < subBuckets)
+    return bucket;
 
-  return 0;
+  int shift = (bucket >> XVFBSYNC_HISTOGRAM_SUB_BITS) - 1;
+  uint64_t low = (uint64_t)(subBuckets + (bucket & (subBuckets - 1))) << shift;
+  return low + (UINT64_C(1) << shift) - 1;
 }
 
-void xvfbsync_syncIP_depopulate (struct SyncIp1* syncIP)
+static void xvfbsync_histogram_record (struct LatencyHistogram1* histogram, uint64_t value)
 {
-  syncIP->quit = true;
-  pthread_join (syncIP->pollingThread, NULL);
-  pthread_mutex_destroy (&(syncIP->mutex));
-  free (syncIP->channelStatuses);
-  free (syncIP->eventListeners);
-}
+  atomic_fetch_add_explicit (&histogram->counts[xvfbsync_histogram_bucket (value)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&histogram->total, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&histogram->sum, value, memory_order_relaxed);
 
-/* ************************* */
-/* xvfbsync syncChan helpers */
-/* ************************* */
+  uint64_t max = atomic_load_explicit (&histogram->max, memory_order_relaxed);
 
-static const TFourCCMapping FourCCMappings[] =
+  while (value > max && !atomic_compare_exchange_weak_explicit (&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+static void xvfbsync_histogram_reset (struct LatencyHistogram1* histogram)
 {
-  // planar: 8b
-  FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '4', '2', '0'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_U_V, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', 'Y', 'U', 'V'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_U_V, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', 'V', '1', '2'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_V_U, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '4', '2', '2'), CHROMA_4_2_2, 8, FB_RASTER, C_ORDER_U_V, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', 'V', '1', '6'), CHROMA_4_2_2, 8, FB_RASTER, C_ORDER_U_V, false, false)
-  // planar: 10b
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '0', 'A', 'L'), CHROMA_4_2_0, 10, FB_RASTER, C_ORDER_U_V, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '2', 'A', 'L'), CHROMA_4_2_2, 10, FB_RASTER, C_ORDER_U_V, false, false)
+  for (int i = 0; i < XVFBSYNC_HISTOGRAM_BUCKETS; ++i)
+    atomic_store_explicit (&histogram->counts[i], 0, memory_order_relaxed);
 
-  // semi-planar: 8b
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('N', 'V', '1', '2'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('N', 'V', '1', '6'), CHROMA_4_2_2, 8, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
-  // semi-planar: 10b
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('P', '0', '1', '0'), CHROMA_4_2_0, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('P', '2', '1', '0'), CHROMA_4_2_2, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
+  atomic_store_explicit (&histogram->total, 0, memory_order_relaxed);
+  atomic_store_explicit (&histogram->sum, 0, memory_order_relaxed);
+  atomic_store_explicit (&histogram->max, 0, memory_order_relaxed);
+}
 
-  // monochrome
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', '8', '0', '0'), CHROMA_4_0_0, 8, FB_RASTER, C_ORDER_NO_CHROMA, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', '0', '1', '0'), CHROMA_4_0_0, 10, FB_RASTER, C_ORDER_NO_CHROMA, false, false)
+/* Only slots programmed with an explicit fb_id are tracked: the slot the
+ * driver picks when it is asked to auto search isn't reported back, so
+ * neither its latency nor its release can be known */
+static void xvfbsync_latency_programmed (struct SyncIp1* syncIP, int chanId, int fbId)
+{
+  if (chanId < 0 || chanId >= syncIP->maxChannels || fbId < 0 || fbId >= MAX_FB_NUMBER)
+    return;
 
-  // tile : 64x4
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '0', '8'), CHROMA_4_2_0, 8, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '2', '8'), CHROMA_4_2_2, 8, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', 'm', '8'), CHROMA_4_0_0, 8, FB_TILE_64x4, C_ORDER_NO_CHROMA, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '0', 'A'), CHROMA_4_2_0, 10, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '2', 'A'), CHROMA_4_2_2, 10, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', 'm', 'A'), CHROMA_4_0_0, 10, FB_TILE_64x4, C_ORDER_NO_CHROMA, false, false)
-  // tile : 32x4
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '0', '8'), CHROMA_4_2_0, 8, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '2', '8'), CHROMA_4_2_2, 8, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', 'm', '8'), CHROMA_4_0_0, 8, FB_TILE_32x4, C_ORDER_NO_CHROMA, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '0', 'A'), CHROMA_4_2_0, 10, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '2', 'A'), CHROMA_4_2_2, 10, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', 'm', 'A'), CHROMA_4_0_0, 10, FB_TILE_32x4, C_ORDER_NO_CHROMA, false, false)
+  struct ChannelLatency1* latency = &syncIP->channels[chanId].latency;
+  uint64_t now = xvfbsync_now ();
 
+  pthread_mutex_lock (&latency->mutex);
+  latency->programmedAt[fbId] = now;
 
-  // 10b packed
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('X', 'V', '1', '0'), CHROMA_4_0_0, 10, FB_RASTER, C_ORDER_NO_CHROMA, false, true)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('X', 'V', '1', '5'), CHROMA_4_2_0, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, true)
-  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('X', 'V', '2', '0'), CHROMA_4_2_2, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, true)
-};
+  for (int user = 0; user < MAX_USER; ++user)
+    latency->doneAt[fbId][user] = 0;
 
-static const int FourCCMappingSize = sizeof(FourCCMappings) / sizeof(FourCCMappings[0]);
+  pthread_mutex_unlock (&latency->mutex);
+}
 
+/* Disabling a channel frees all its slots, the completions of the buffers
+ * they held won't come */
+static void xvfbsync_latency_forget (struct SyncIp1* syncIP, int chanId)
+{
+  struct ChannelLatency1* latency = &syncIP->channels[chanId].latency;
 
-static bool GetPicFormat(uint32_t tFourCC, TPicFormat* tPicFormat)
+  pthread_mutex_lock (&latency->mutex);
+  memset (latency->programmedAt, 0, sizeof (latency->programmedAt));
+  memset (latency->doneAt, 0, sizeof (latency->doneAt));
+  pthread_mutex_unlock (&latency->mutex);
+}
+
+/* Returns true when both users are done with the slot */
+static bool xvfbsync_latency_done (struct SyncIp1* syncIP, int chanId, int fbId, int user, uint64_t now)
 {
-  const TFourCCMapping* pBeginMapping = &FourCCMappings[0];
-  const TFourCCMapping* pEndMapping = pBeginMapping + FourCCMappingSize;
+  struct ChannelLatency1* latency = &syncIP->channels[chanId].latency;
+  bool released = false;
+
+  pthread_mutex_lock (&latency->mutex);
+
+  uint64_t programmedAt = latency->programmedAt[fbId];
+
+  if (!programmedAt || latency->doneAt[fbId][user]) {
+    pthread_mutex_unlock (&latency->mutex);
+    return false;
+  }
 
-  for(const TFourCCMapping* pMapping = pBeginMapping; pMapping != pEndMapping; pMapping++)
+  latency->doneAt[fbId][user] = now;
+
+  if (user == XVSFSYNC_PROD)
+    xvfbsync_histogram_record (&latency->histograms[LATENCY_PRODUCER_DONE], now - programmedAt);
+  else
   {
-    if(pMapping->tfourCC == tFourCC)
-    {
-      *tPicFormat = pMapping->tPictFormat;
-      return true;
-    }
+    xvfbsync_histogram_record (&latency->histograms[LATENCY_CONSUMER_DONE], now - programmedAt);
+
+    uint64_t producerDoneAt = latency->doneAt[fbId][XVSFSYNC_PROD];
+
+    if (producerDoneAt && producerDoneAt <= now)
+      xvfbsync_histogram_record (&latency->histograms[LATENCY_PRODUCER_TO_CONSUMER], now - producerDoneAt);
   }
 
-  assert(0);
+  /* both users released the slot, the driver can reuse it */
+  if (latency->doneAt[fbId][XVSFSYNC_PROD] && latency->doneAt[fbId][XVSFSYNC_CONS])
+  {
+    latency->programmedAt[fbId] = 0;
 
-  return false;
-}
+    for (int i = 0; i < MAX_USER; ++i)
+      latency->doneAt[fbId][i] = 0;
 
+    released = true;
+  }
 
-bool IsTiled(uint32_t tFourCC)
-{
-  TPicFormat tPicFormat;
-  return GetPicFormat(tFourCC, &tPicFormat) && (tPicFormat.eStorageMode != FB_RASTER);
+  pthread_mutex_unlock (&latency->mutex);
+  return released;
 }
 
-EChromaMode GetChromaMode(uint32_t tFourCC)
-{
-  TPicFormat tPicFormat;
-  return GetPicFormat(tFourCC, &tPicFormat) ? tPicFormat.eChromaMode : (EChromaMode) - 1;
-}
+/* *********************** */
+/* xvfbsync syncIP helpers */
+/* *********************** */
 
-bool IsSemiPlanar(uint32_t tFourCC)
+static int xvfbsync_device_ioctl (void* opaque, int fd, unsigned long request, void* arg)
 {
-  TPicFormat tPicFormat;
-  return GetPicFormat(tFourCC, &tPicFormat) && (tPicFormat.eChromaOrder == C_ORDER_SEMIPLANAR);
+  (void)opaque;
+  return ioctl (fd, request, arg);
 }
 
-bool IsMonochrome(uint32_t tFourCC)
+static int xvfbsync_device_poll (void* opaque, struct pollfd* fds, nfds_t nfds, int timeout)
 {
-  return GetChromaMode(tFourCC) == CHROMA_MONO;
+  (void)opaque;
+  return poll (fds, nfds, timeout);
 }
 
-static int RoundUp (int iVal, int iRnd)
+static const struct SyncIpDeviceOps1 xvfbsync_deviceOps =
 {
-  assert ((iRnd % 2) == 0);
-  return (iVal + iRnd - 1) / iRnd * iRnd;
-}
- 
-static void printFrameBufferConfig(struct xvsfsync_chan_config* config, int maxUsers, int maxCores)
+  .ioctl = &xvfbsync_device_ioctl,
+  .poll = &xvfbsync_device_poll,
+};
+
+/* errno is the one of the driver call when it returns. EBUSY failures
+ * aren't counted in the statistics unless busyIsFailure is set */
+static int xvfbsync_syncIP_ioctlTry(struct SyncIp1* syncIP, int chanId, unsigned long request, void* arg, bool busyIsFailure)
 {
-  printf ("********************************\n");
-  printf ("channel_id:%d\n", config->channel_id);
-  printf ("luma_margin:%d\n", config->luma_margin);
-  printf ("chroma_margin:%d\n", config->chroma_margin);
+  uint64_t start = xvfbsync_now ();
+  int ret = syncIP->ops->ioctl (syncIP->opsOpaque, syncIP->fd, request, arg);
+  int error = ret ? errno : 0;
+  uint64_t duration = xvfbsync_now () - start;
 
-  for (int user = 0; user < maxUsers; ++user)
-  {
-    printf ("%s[%d]:\n", (user == XVSFSYNC_PROD) ? "prod" : (user == XVSFSYNC_CONS) ? "cons" : "unknown", user);
-    printf ("\t-fb_id:%d %s\n", config->fb_id[user], config->fb_id[user] == XVSFSYNC_AUTO_SEARCH ? "(auto_search)" : "");
-    printf ("\t-ismono:%s\n", (config->ismono[user] == 0) ? "false" : "true");
-    printf ("\t-luma_start_address:%" PRIx64 "\n", config->luma_start_address[user]);
-    printf ("\t-luma_end_address:%" PRIx64 "\n", config->luma_end_address[user]);
-    printf ("\t-chroma_start_address:%" PRIx64 "\n", config->chroma_start_address[user]);
-    printf ("\t-chroma_end_address:%" PRIx64 "\n", config->chroma_end_address[user]);
+  if (atomic_load_explicit (&syncIP->recording, memory_order_relaxed))
+    xvfbsync_record_write (syncIP, chanId, request, arg, ret, start, duration);
+
+  struct StatsCounters1* counters = xvfbsync_stats_counters (syncIP, chanId);
+
+  if (counters) {
+    xvfbsync_stats_add (&counters->ioctls, 1);
+    xvfbsync_stats_add (&counters->ioctlTimeNs, duration);
+
+    if (ret && (busyIsFailure || error != EBUSY))
+      xvfbsync_stats_add (&counters->ioctlFailures, 1);
   }
 
-  for (int core = 0; core < maxCores; ++core)
+  /* commands that change the channel statuses */
+  switch (request)
   {
-    printf ("core[%i]:\n", core);
-    printf ("\t-luma_core_offset:%d\n", config->luma_core_offset[core]);
-    printf ("\t-chroma_core_offset:%d\n", config->chroma_core_offset[core]);
+  case XVSFSYNC_SET_CHAN_CONFIG:
+  case XVSFSYNC_CHAN_ENABLE:
+  case XVSFSYNC_CHAN_DISABLE:
+  case XVSFSYNC_CLR_CHAN_ERR:
+  case XVSFSYNC_CLR_CHAN_FBDONE_STAT:
+    atomic_store_explicit (&syncIP->statusStale, true, memory_order_release);
+    break;
+  default:
+    break;
   }
 
-  printf ("********************************\n");
+  xvfbsync_trace_record (syncIP, TRACE_IOCTL, chanId, _IOC_NR(request), ret, duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration);
+
+  /* the recording and the statistics may have clobbered it */
+  errno = error;
+  return ret;
 }
 
-static int xvsfsync_chan_getLumaSize(LLP2Buf* buf)
+static int xvfbsync_syncIP_ioctl(struct SyncIp1* syncIP, int chanId, unsigned long request, void* arg)
 {
-  if(IsTiled(buf->tFourCC))
-    return buf->tPlanes[PLANE_Y].iPitch * buf->tDim.iHeight / 4;
-  return buf->tPlanes[PLANE_Y].iPitch * buf->tDim.iHeight;
+  return xvfbsync_syncIP_ioctlTry (syncIP, chanId, request, arg, true);
 }
 
-static int xvsfsync_chan_getChromaSize(LLP2Buf* buf)
+/* A channel status fits in one word, so it can be published and read
+ * atomically without any lock */
+#define STATUS_FB_AVAIL(buffer, user) BIT((buffer) * MAX_USER + (user))
+#define STATUS_ENABLE BIT(MAX_FB_NUMBER * MAX_USER)
+#define STATUS_SYNC_ERROR BIT(MAX_FB_NUMBER * MAX_USER + 1)
+#define STATUS_WATCHDOG_ERROR BIT(MAX_FB_NUMBER * MAX_USER + 2)
+#define STATUS_LUMA_DIFF_ERROR BIT(MAX_FB_NUMBER * MAX_USER + 3)
+#define STATUS_CHROMA_DIFF_ERROR BIT(MAX_FB_NUMBER * MAX_USER + 4)
+#define STATUS_ERRORS (STATUS_SYNC_ERROR | STATUS_WATCHDOG_ERROR | STATUS_LUMA_DIFF_ERROR | STATUS_CHROMA_DIFF_ERROR)
+
+static uint32_t parseChanStatus (struct xvsfsync_stat* status, int channel,
+  int maxUsers, int maxBuffers)
 {
-  EChromaMode eCMode = GetChromaMode(buf->tFourCC);
+  uint32_t packed = 0;
 
-  if(eCMode == CHROMA_MONO)
-    return 0;
+  for (int buffer = 0; buffer < maxBuffers; ++buffer)
+  {
+    for (int user = 0; user < maxUsers; ++user)
+      packed |= status->fbdone[channel][buffer][user] ? STATUS_FB_AVAIL(buffer, user) : 0;
+  }
 
-  int const iHeightC = (eCMode == CHROMA_4_2_0) ? buf->tDim.iHeight / 2 : buf->tDim.iHeight;
+  packed |= status->enable[channel] ? STATUS_ENABLE : 0;
+  packed |= status->sync_err[channel] ? STATUS_SYNC_ERROR : 0;
+  packed |= status->wdg_err[channel] ? STATUS_WATCHDOG_ERROR : 0;
+  packed |= status->ldiff_err[channel] ? STATUS_LUMA_DIFF_ERROR : 0;
+  packed |= status->cdiff_err[channel] ? STATUS_CHROMA_DIFF_ERROR : 0;
+  return packed;
+}
 
-  if(IsTiled(buf->tFourCC))
+static void unpackChanStatus (uint32_t packed, struct ChannelStatus1* channelStatus)
+{
+  for (int buffer = 0; buffer < MAX_FB_NUMBER; ++buffer)
+  {
+    for (int user = 0; user < MAX_USER; ++user)
+      channelStatus->fbAvail[buffer][user] = packed & STATUS_FB_AVAIL(buffer, user);
+  }
+
+  channelStatus->enable = packed & STATUS_ENABLE;
+  channelStatus->syncError = packed & STATUS_SYNC_ERROR;
+  channelStatus->watchdogError = packed & STATUS_WATCHDOG_ERROR;
+  channelStatus->lumaDiffError = packed & STATUS_LUMA_DIFF_ERROR;
+  channelStatus->chromaDiffError = packed & STATUS_CHROMA_DIFF_ERROR;
+}
+
+static int xvfbsync_syncIP_getLatestChanStatus(struct SyncIp1* syncIP)
+{
+  struct xvsfsync_stat chan_status;
+
+  /* cleared before the fetch so changes reported meanwhile aren't lost */
+  atomic_store_explicit (&syncIP->statusStale, false, memory_order_release);
+  int ret = xvfbsync_syncIP_ioctl (syncIP, -1, XVSFSYNC_GET_CHAN_STATUS, &chan_status);
+
+  xvfbsync_trace_record (syncIP, TRACE_STATUS_FETCH, -1, 0, ret, 0);
+
+  if (ret) {
+    xvfbsync_print ("Couldn't get sync ip channel status");
+    atomic_store_explicit (&syncIP->statusStale, true, memory_order_release);
+    return -1;
+  }
+
+  for (int channel = 0; channel < syncIP->maxChannels; ++channel)
+  {
+    uint32_t packed = parseChanStatus (&chan_status, channel, syncIP->maxUsers, syncIP->maxBuffers);
+    atomic_store_explicit (&syncIP->channels[channel].status, packed, memory_order_release);
+  }
+
+  atomic_store_explicit (&syncIP->statusRefreshedAt, xvfbsync_now (), memory_order_release);
+  atomic_fetch_add_explicit (&syncIP->statusGeneration, 1, memory_order_acq_rel);
+  return 0;
+}
+
+/* Fetch the channel statuses only if the cached ones may be wrong or are
+ * older than maxAgeNs. Concurrent refreshes are harmless: each channel
+ * status is a single word, readers always see a whole one */
+static int xvfbsync_syncIP_refreshStatus(struct SyncIp1* syncIP, uint64_t maxAgeNs)
+{
+  if (!atomic_load_explicit (&syncIP->statusStale, memory_order_acquire) &&
+    xvfbsync_now () - atomic_load_explicit (&syncIP->statusRefreshedAt, memory_order_acquire) <= maxAgeNs)
+    return 0;
+
+  return xvfbsync_syncIP_getLatestChanStatus (syncIP);
+}
+
+static void xvfbsync_syncIP_resetStatus(struct SyncIp1* syncIP, int chanId)
+{
+  struct xvsfsync_clr_err clr;
+  clr.channel_id = chanId;
+  clr.sync_err = 1;
+  clr.wdg_err = 1;
+  clr.ldiff_err = 1;
+  clr.cdiff_err = 1;
+
+  if (xvfbsync_syncIP_ioctl (syncIP, chanId, XVSFSYNC_CLR_CHAN_ERR, &clr))
+    xvfbsync_print ("Couldnt reset status of channel %d", chanId);
+}
+
+static void xvfbsync_syncIP_enableChannel(struct SyncIp1* syncIP, int chanId)
+{
+  u8 chan = chanId;
+  int ret = xvfbsync_syncIP_ioctl (syncIP, chanId, XVSFSYNC_CHAN_ENABLE, (void*)(uintptr_t)chan);
+
+  xvfbsync_trace_record (syncIP, TRACE_CHANNEL_ENABLE, chanId, 0, ret, 0);
+
+  if (ret)
+    xvfbsync_print ("Couldn't enable channel %d\n", chanId);
+}
+
+static void xvfbsync_syncIP_disableChannel(struct SyncIp1* syncIP, int chanId)
+{
+  u8 chan = chanId;
+  int ret = xvfbsync_syncIP_ioctl (syncIP, chanId, XVSFSYNC_CHAN_DISABLE, (void*)(uintptr_t)chan);
+
+  xvfbsync_trace_record (syncIP, TRACE_CHANNEL_DISABLE, chanId, 0, ret, 0);
+  xvfbsync_latency_forget (syncIP, chanId);
+
+  if (ret)
+    xvfbsync_print ("Couldn't disable channel %d\n", chanId);
+}
+
+static int xvfbsync_syncIP_addBuffer(struct SyncIp1* syncIP, struct xvsfsync_chan_config* fbConfig)
+{
+  int ret = xvfbsync_syncIP_ioctl (syncIP, fbConfig->channel_id, XVSFSYNC_SET_CHAN_CONFIG, fbConfig);
+
+  int error = ret ? errno : 0;
+
+  xvfbsync_trace_record (syncIP, TRACE_BUFFER_PROGRAMMED, fbConfig->channel_id, (uint32_t)fbConfig->luma_start_address[XVSFSYNC_PROD], ret, 0);
+
+  if (ret)
+    xvfbsync_print ("Couldn't add buffer (errno: %d)\n", error);
+  else {
+    struct StatsCounters1* counters = xvfbsync_stats_counters (syncIP, fbConfig->channel_id);
+
+    if (counters)
+      xvfbsync_stats_add (&counters->buffersProgrammed, 1);
+
+    xvfbsync_latency_programmed (syncIP, fbConfig->channel_id, fbConfig->fb_id[XVSFSYNC_PROD]);
+  }
+
+  /* the callers tell a busy slot apart from a refused config */
+  errno = error;
+  return ret;
+}
+
+/* Add events to the channel pending events and wake up its eventfd if
+ * nothing was pending (called with the channel lock held) */
+static void xvfbsync_syncIP_notify(struct ChannelState1* channel, uint32_t events)
+{
+  if (channel->notifyFd == -1 || !events)
+    return;
+
+  uint32_t pending = atomic_fetch_or_explicit (&channel->pendingEvents, events, memory_order_acq_rel);
+
+  if (!pending) {
+    uint64_t one = 1;
+
+    if (write (channel->notifyFd, &one, sizeof (one)) != sizeof (one))
+      xvfbsync_print ("Couldn't signal the channel eventfd\n");
+  }
+}
+
+/* Read which framebuffers were released by their producer/consumer since
+ * last time, acknowledge them and feed the latency histograms.
+ * The sync ip can be shared with another process, only the channels
+ * reserved here are looked at and acknowledged */
+static void xvfbsync_syncIP_processFbDone(struct SyncIp1* syncIP)
+{
+  struct xvsfsync_fbdone fbdone;
+  uint64_t now = xvfbsync_now ();
+
+  if (xvfbsync_syncIP_ioctl (syncIP, -1, XVSFSYNC_GET_CHAN_FBDONE_STAT, &fbdone)) {
+    xvfbsync_print ("Couldn't get framebuffer done status, stop tracking completions\n");
+    syncIP->trackFbDone = false;
+    return;
+  }
+
+  uint32_t owned = atomic_load_explicit (&syncIP->reservedChannels, memory_order_acquire);
+  bool anyDone = false;
+  uint32_t released[XVSFSYNC_MAX_ENC_CHANNEL] = { 0 };
+  uint32_t progressed = 0;
+
+  for (int channel = 0; channel < XVSFSYNC_MAX_ENC_CHANNEL; ++channel)
+  {
+    if (channel >= syncIP->maxChannels || !(owned & BIT(channel))) {
+      memset (fbdone.status[channel], 0, sizeof (fbdone.status[channel]));
+      continue;
+    }
+
+    for (int buffer = 0; buffer < syncIP->maxBuffers; ++buffer)
+    {
+      for (int user = 0; user < syncIP->maxUsers; ++user)
+      {
+        if (!fbdone.status[channel][buffer][user])
+          continue;
+
+        anyDone = true;
+        progressed |= BIT(channel);
+
+        if (xvfbsync_latency_done (syncIP, channel, buffer, user, now))
+          released[channel] |= BIT(buffer);
+      }
+    }
+  }
+
+  /* the done bits stay set (and the device readable) until we clear them.
+   * They are cleared before the slots are handed back, so the done bits of
+   * a reprogrammed slot can't be cleared by mistake */
+  if (anyDone && xvfbsync_syncIP_ioctl (syncIP, -1, XVSFSYNC_CLR_CHAN_FBDONE_STAT, &fbdone)) {
+    xvfbsync_print ("Couldn't clear framebuffer done status, stop tracking completions\n");
+    syncIP->trackFbDone = false;
+  }
+
+  for (int channel = 0; channel < syncIP->maxChannels && channel < XVSFSYNC_MAX_ENC_CHANNEL; ++channel)
+  {
+    if (!(progressed & BIT(channel)))
+      continue;
+
+    struct ChannelState1* state = &syncIP->channels[channel];
+    struct StatsCounters1* counters = xvfbsync_stats_counters (syncIP, channel);
+
+    if (counters)
+      xvfbsync_stats_add (&counters->framebuffersDone, __builtin_popcount (released[channel]));
+
+    pthread_mutex_lock (&state->mutex);
+    xvfbsync_syncIP_notify (state, released[channel] & XVFBSYNC_EVENT_FB_DONE_MASK);
+
+    if (state->eventHandler)
+      state->eventHandler (state->eventOpaque, (released[channel] & XVFBSYNC_EVENT_FB_DONE_MASK) | XVFBSYNC_EVENT_PROGRESS);
+
+    pthread_mutex_unlock (&state->mutex);
+  }
+}
+
+static void xvfbsync_syncIP_dispatchErrors(struct SyncIp1* syncIP)
+{
+  if (xvfbsync_syncIP_getLatestChanStatus (syncIP))
+    return;
+
+  for (int i = 0; i < syncIP->maxChannels; ++i)
+  {
+    struct ChannelState1* channel = &syncIP->channels[i];
+    uint32_t packed = atomic_load_explicit (&channel->status, memory_order_acquire);
+
+    if (!(packed & STATUS_ERRORS))
+      continue;
+
+    struct ChannelStatus1 status;
+    unpackChanStatus (packed, &status);
+
+    uint32_t errors = (status.syncError ? TRACE_ERROR_SYNC : 0) | (status.watchdogError ? TRACE_ERROR_WATCHDOG : 0) |
+      (status.lumaDiffError ? TRACE_ERROR_LUMA_DIFF : 0) | (status.chromaDiffError ? TRACE_ERROR_CHROMA_DIFF : 0);
+    xvfbsync_trace_record (syncIP, TRACE_ERROR, i, errors, 0, 0);
+
+    struct StatsCounters1* counters = xvfbsync_stats_counters (syncIP, i);
+
+    if (counters) {
+      xvfbsync_stats_add (&counters->errors[STATS_ERROR_SYNC], status.syncError);
+      xvfbsync_stats_add (&counters->errors[STATS_ERROR_WATCHDOG], status.watchdogError);
+      xvfbsync_stats_add (&counters->errors[STATS_ERROR_LUMA_DIFF], status.lumaDiffError);
+      xvfbsync_stats_add (&counters->errors[STATS_ERROR_CHROMA_DIFF], status.chromaDiffError);
+    }
+
+    uint32_t events = (status.syncError ? XVFBSYNC_EVENT_SYNC_ERROR : 0) | (status.watchdogError ? XVFBSYNC_EVENT_WATCHDOG_ERROR : 0) |
+      (status.lumaDiffError ? XVFBSYNC_EVENT_LUMA_DIFF_ERROR : 0) | (status.chromaDiffError ? XVFBSYNC_EVENT_CHROMA_DIFF_ERROR : 0);
+
+    /* the listener is called with the channel lock held, so it can't run
+     * anymore once removeListener returned */
+    pthread_mutex_lock (&channel->mutex);
+
+    if(channel->listener)
+      channel->listener (&status);
+
+    xvfbsync_syncIP_notify (channel, events);
+
+    channel->errorsHandled = false;
+
+    if (channel->eventHandler)
+      channel->eventHandler (channel->eventOpaque, events);
+
+    /* cleared even without listener, the device stays readable otherwise.
+     * A channel restart already cleared them, an error raised since must
+     * not be lost */
+    if (!channel->errorsHandled)
+      xvfbsync_syncIP_resetStatus(syncIP, i);
+
+    pthread_mutex_unlock (&channel->mutex);
+  }
+}
+
+/* Milliseconds until the earliest deferred channel restart is due (rounded
+ * up), -1 if none is pending */
+static int xvfbsync_syncIP_retryTimeout(struct SyncIp1* syncIP)
+{
+  uint64_t next = 0;
+
+  for (int i = 0; i < syncIP->maxChannels; ++i)
+  {
+    uint64_t retryAt = atomic_load_explicit (&syncIP->channels[i].retryAt, memory_order_acquire);
+
+    if (retryAt && (!next || retryAt < next))
+      next = retryAt;
+  }
+
+  if (!next)
+    return -1;
+
+  uint64_t now = xvfbsync_now ();
+
+  if (next <= now)
+    return 0;
+
+  uint64_t timeout = (next - now + 999999) / 1000000;
+  return timeout > INT_MAX ? INT_MAX : (int)timeout;
+}
+
+/* Shortest of two poll timeouts, -1 waits forever */
+static int xvfbsync_timeout_min(int a, int b)
+{
+  if (a < 0)
+    return b;
+
+  if (b < 0)
+    return a;
+
+  return MIN(a, b);
+}
+
+/* Ask for XVFBSYNC_EVENT_RETRY on the event handler of chanId once at is
+ * reached, an earlier request stands. The event thread is woken up to
+ * shorten its wait when the request comes first */
+static void xvfbsync_syncIP_armRetry(struct SyncIp1* syncIP, int chanId, uint64_t at)
+{
+  _Atomic uint64_t* retryAt = &syncIP->channels[chanId].retryAt;
+  uint64_t current = atomic_load_explicit (retryAt, memory_order_acquire);
+
+  while (!current || at < current)
+  {
+    if (atomic_compare_exchange_weak_explicit (retryAt, &current, at, memory_order_acq_rel, memory_order_acquire)) {
+      uint64_t wake = 1;
+
+      if (write (syncIP->retryFd, &wake, sizeof (wake)) != sizeof (wake))
+        xvfbsync_print ("Couldn't wake up the event thread\n");
+      return;
+    }
+  }
+}
+
+/* Hand the retries that are due to their channel, on the event thread like
+ * the errors that deferred them, once all the events were dispatched */
+static void xvfbsync_syncIP_runRetries(struct SyncIp1* syncIP)
+{
+  uint64_t now = xvfbsync_now ();
+
+  for (int i = 0; i < syncIP->maxChannels; ++i)
+  {
+    struct ChannelState1* channel = &syncIP->channels[i];
+    uint64_t retryAt = atomic_load_explicit (&channel->retryAt, memory_order_acquire);
+
+    if (!retryAt || retryAt > now)
+      continue;
+
+    pthread_mutex_lock (&channel->mutex);
+
+    /* the channel may have been disabled meanwhile, which cancels it */
+    if (atomic_exchange_explicit (&channel->retryAt, 0, memory_order_acq_rel) && channel->eventHandler)
+      channel->eventHandler (channel->eventOpaque, XVFBSYNC_EVENT_RETRY);
+
+    pthread_mutex_unlock (&channel->mutex);
+  }
+}
+
+/* Handle what the device reported in revents.
+ * Returns false if the device can't be polled anymore. */
+static bool xvfbsync_syncIP_handleEvents(struct SyncIp1* syncIP, short revents)
+{
+  /* completions change the framebuffer availability of the channels */
+  if (revents & POLLIN) {
+    atomic_store_explicit (&syncIP->statusStale, true, memory_order_release);
+    xvfbsync_syncIP_processFbDone (syncIP);
+  }
+
+  if (revents & POLLPRI)
+    xvfbsync_syncIP_dispatchErrors (syncIP);
+
+  if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    xvfbsync_print ("Sync ip stopped answering while polling the errors\n");
+    return false;
+  }
+
+  return true;
+}
+
+/* Drop the wake ups of the retry eventfd, the retries are looked at anyway */
+static void xvfbsync_syncIP_clearRetryFd(struct SyncIp1* syncIP)
+{
+  uint64_t count;
+
+  if (read (syncIP->retryFd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    xvfbsync_print ("Couldn't read the retry eventfd\n");
+}
+
+/* Sleep until the driver signals an error (POLLPRI on the device), a
+ * framebuffer completion (POLLIN), a retry is armed or until depopulate
+ * wakes us through the quit eventfd.
+ * Returns false when the polling thread should stop. */
+static bool xvfbsync_syncIP_pollErrors(struct SyncIp1* syncIP, int timeout)
+{
+  struct pollfd fds[3];
+
+  fds[0].fd = syncIP->fd;
+  fds[0].events = POLLPRI | (syncIP->trackFbDone ? POLLIN : 0);
+  fds[0].revents = 0;
+  fds[1].fd = syncIP->quitFd;
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+  fds[2].fd = syncIP->retryFd;
+  fds[2].events = POLLIN;
+  fds[2].revents = 0;
+
+  /* wake up in time for the deferred channel restarts */
+  int ret = syncIP->ops->poll (syncIP->opsOpaque, fds, 3, xvfbsync_timeout_min (timeout, xvfbsync_syncIP_retryTimeout (syncIP)));
+
+  if (ret == 0) {
+    xvfbsync_syncIP_runRetries (syncIP);
+    return true;
+  }
+
+  if (ret < 0) {
+    if (errno == EINTR)
+      return true;
+    xvfbsync_print ("Error while polling the errors. (errno: %d)\n", errno);
+    return false;
+  }
+
+  /* handle the device first so errors raised right before quit are still reported */
+  if (!xvfbsync_syncIP_handleEvents (syncIP, fds[0].revents))
+    return false;
+
+  if (fds[2].revents & POLLIN)
+    xvfbsync_syncIP_clearRetryFd (syncIP);
+
+  xvfbsync_syncIP_runRetries (syncIP);
+
+  return !(fds[1].revents & POLLIN);
+}
+
+static void* xvfbsync_syncIP_pollingRoutine(void* arg)
+{
+  struct SyncIp1* syncIP = ((struct ThreadInfo*)arg)->syncIP;
+
+  while (xvfbsync_syncIP_pollErrors (syncIP, -1))
+    ;
+
+  free ((struct ThreadInfo*)arg);
+  return NULL;
+}
+
+static void xvfbsync_syncIP_addListener(struct SyncIp1* syncIP, int chanId, void (*delegate)(struct ChannelStatus1*))
+{
+  struct ChannelState1* channel = &syncIP->channels[chanId];
+
+  pthread_mutex_lock (&channel->mutex);
+  channel->listener = delegate;
+  pthread_mutex_unlock (&channel->mutex);
+}
+
+static void xvfbsync_syncIP_removeListener(struct SyncIp1* syncIP, int chanId)
+{
+  struct ChannelState1* channel = &syncIP->channels[chanId];
+
+  pthread_mutex_lock (&channel->mutex);
+  channel->listener = NULL;
+  pthread_mutex_unlock (&channel->mutex);
+}
+
+static int xvfbsync_syncIP_openEventFd(struct SyncIp1* syncIP, int chanId)
+{
+  struct ChannelState1* channel = &syncIP->channels[chanId];
+  int fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if (fd == -1) {
+    xvfbsync_print ("Couldn't create the eventfd of channel %d\n", chanId);
+    return -1;
+  }
+
+  pthread_mutex_lock (&channel->mutex);
+  channel->notifyFd = fd;
+  atomic_store_explicit (&channel->pendingEvents, 0, memory_order_relaxed);
+  pthread_mutex_unlock (&channel->mutex);
+  return 0;
+}
+
+static void xvfbsync_syncIP_closeEventFd(struct SyncIp1* syncIP, int chanId)
+{
+  struct ChannelState1* channel = &syncIP->channels[chanId];
+
+  pthread_mutex_lock (&channel->mutex);
+  int fd = channel->notifyFd;
+  channel->notifyFd = -1;
+  pthread_mutex_unlock (&channel->mutex);
+
+  if (fd != -1)
+    close (fd);
+}
+
+/* The eventfd is reset before the events are taken: an event added in
+ * between can only cause a spurious wake up, never a lost one */
+static uint32_t xvfbsync_syncIP_drainEvents(struct SyncIp1* syncIP, int chanId)
+{
+  struct ChannelState1* channel = &syncIP->channels[chanId];
+  uint64_t count;
+
+  if (read (channel->notifyFd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    xvfbsync_print ("Couldn't reset the eventfd of channel %d\n", chanId);
+
+  return atomic_exchange_explicit (&channel->pendingEvents, 0, memory_order_acq_rel);
+}
+
+/* handler is called from the event thread with the channel lock held with
+ * the XVFBSYNC_EVENT_* of the channel: each time both users released
+ * framebuffer slots and each time errors are raised */
+static void xvfbsync_syncIP_setEventHandler(struct SyncIp1* syncIP, int chanId, void (*handler)(void*, uint32_t), void* opaque)
+{
+  struct ChannelState1* channel = &syncIP->channels[chanId];
+
+  pthread_mutex_lock (&channel->mutex);
+  channel->eventHandler = handler;
+  channel->eventOpaque = opaque;
+  pthread_mutex_unlock (&channel->mutex);
+}
+
+uint64_t xvfbsync_syncIP_getChanStatus(struct SyncIp1* syncIP, int chanId, struct ChannelStatus1* status, uint64_t maxAgeNs)
+{
+  if (chanId < 0 || chanId >= syncIP->maxChannels)
+    return 0;
+
+  if (xvfbsync_syncIP_refreshStatus (syncIP, maxAgeNs))
+    return 0;
+
+  /* the generation is read first, so the copy is at least that recent */
+  uint64_t generation = atomic_load_explicit (&syncIP->statusGeneration, memory_order_acquire);
+  unpackChanStatus (atomic_load_explicit (&syncIP->channels[chanId].status, memory_order_acquire), status);
+  return generation;
+}
+
+/* Everything populate does except starting the event handling */
+static int xvfbsync_syncIP_init(struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque)
+{
+  syncIP->fd = fd;
+  syncIP->ops = ops ? ops : &xvfbsync_deviceOps;
+  syncIP->opsOpaque = opaque;
+  syncIP->manager = NULL;
+  syncIP->eThreading = THREADING_DEDICATED;
+  syncIP->quitFd = -1;
+  syncIP->retryFd = -1;
+  syncIP->stats = NULL;
+  syncIP->statsFd = -1;
+  atomic_init (&syncIP->recording, false);
+  syncIP->recordFile = NULL;
+
+  if (syncIP->fd == -1) {
+    xvfbsync_print ("Couldn't open the sync ip\n");
+    return -1;
+  }
+
+  atomic_init (&syncIP->traceHead, 0);
+  syncIP->traceSlots = calloc (XVFBSYNC_TRACE_SIZE, sizeof (struct TraceSlot1));
+
+  struct xvsfsync_config config;
+  
+  if (xvfbsync_syncIP_ioctl (syncIP, -1, XVSFSYNC_GET_CFG, &config)) {
+    xvfbsync_print ("Couldn't get sync ip configuration\n");
+    free (syncIP->traceSlots);
+    return -1;
+  }
+
+  xvfbsync_print ("[fd: %d] mode: %s, channel number: %d\n", syncIP->fd, 
+    config.encode ? "encode" : "decode", config.max_channels);
+  syncIP->encode = config.encode;
+  syncIP->maxChannels = config.max_channels;
+  syncIP->maxUsers = XVSFSYNC_IO;
+  syncIP->maxBuffers = XVSFSYNC_BUF_PER_CHANNEL;
+  syncIP->maxCores = XVSFSYNC_MAX_CORES;
+  atomic_init (&syncIP->reservedChannels, 0);
+  atomic_init (&syncIP->populatedChannels, 0);
+  atomic_init (&syncIP->statusGeneration, 0);
+  atomic_init (&syncIP->statusRefreshedAt, 0);
+  atomic_init (&syncIP->statusStale, true);
+
+  if (syncIP->maxChannels > 32) {
+    xvfbsync_print ("Sync ip reports too many channels\n");
+    free (syncIP->traceSlots);
+    return -1;
+  }
+  syncIP->trackFbDone = true;
+
+  /* each channel gets its own cache lines so threads driving different
+   * channels don't share them */
+  if (posix_memalign ((void**)&syncIP->channels, XVFBSYNC_CACHE_LINE, config.max_channels * sizeof (struct ChannelState1))) {
+    xvfbsync_print ("Couldn't allocate channels\n");
+    free (syncIP->traceSlots);
+    return -1;
+  }
+
+  memset (syncIP->channels, 0, config.max_channels * sizeof (struct ChannelState1));
+
+  syncIP->retryFd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if (syncIP->retryFd == -1) {
+    xvfbsync_print ("Couldn't create the retry event\n");
+    free (syncIP->channels);
+    free (syncIP->traceSlots);
+    return -1;
+  }
+
+  for (int i = 0; i < syncIP->maxChannels; ++i)
+  {
+    pthread_mutex_init (&syncIP->channels[i].mutex, NULL);
+    pthread_mutex_init (&syncIP->channels[i].latency.mutex, NULL);
+    syncIP->channels[i].notifyFd = -1;
+    atomic_init (&syncIP->channels[i].retryAt, 0);
+  }
+
+  pthread_mutex_init (&syncIP->dmaBufMutex, NULL);
+  memset (syncIP->dmaBufs, 0, sizeof (syncIP->dmaBufs));
+  syncIP->dmaBufNext = 0;
+  pthread_mutex_init (&syncIP->recordMutex, NULL);
+  xvfbsync_stats_init (syncIP);
+  return 0;
+}
+
+static void xvfbsync_syncIP_deinit(struct SyncIp1* syncIP)
+{
+  for (int i = 0; i < syncIP->maxChannels; ++i)
+  {
+    pthread_mutex_destroy (&syncIP->channels[i].mutex);
+    pthread_mutex_destroy (&syncIP->channels[i].latency.mutex);
+  }
+  pthread_mutex_destroy (&syncIP->dmaBufMutex);
+  xvfbsync_syncIP_stopRecording (syncIP);
+  pthread_mutex_destroy (&syncIP->recordMutex);
+  xvfbsync_stats_deinit (syncIP);
+  close (syncIP->retryFd);
+  free (syncIP->channels);
+  free (syncIP->traceSlots);
+}
+
+/* *************** */
+/* xvfbsync syncIP */
+/* *************** */
+
+int xvfbsync_syncIP_reserveChannel(struct SyncIp1* syncIP, int chanId)
+{
+  if (chanId < 0 || chanId >= syncIP->maxChannels)
+    return -1;
+
+  uint32_t mask = BIT(chanId);
+  uint32_t reserved = atomic_fetch_or_explicit (&syncIP->reservedChannels, mask, memory_order_acq_rel);
+  return (reserved & mask) ? -1 : 0;
+}
+
+void xvfbsync_syncIP_releaseChannel(struct SyncIp1* syncIP, int chanId)
+{
+  if (chanId < 0 || chanId >= syncIP->maxChannels)
+    return;
+
+  atomic_fetch_and_explicit (&syncIP->reservedChannels, ~BIT(chanId), memory_order_acq_rel);
+}
+
+int xvfbsync_syncIP_getFreeChannel(struct SyncIp1* syncIP)
+{
+  /* a stale cache could hand out a channel another process started using */
+  if (xvfbsync_syncIP_refreshStatus (syncIP, XVFBSYNC_STATUS_MAX_AGE_NS))
+    return -1;
+
+  /* A channel is free if nobody in this process reserved it and if all its
+   * framebuffers are available in the hardware (it could be used by
+   * another process). The reservation bit is claimed with a compare and
+   * swap, so concurrent callers never get the same channel.
+   */
+  uint32_t reserved = atomic_load_explicit (&syncIP->reservedChannels, memory_order_acquire);
+
+  for(int channel = 0; channel < syncIP->maxChannels; ++channel)
+  {
+    bool isAvailable = true;
+    struct ChannelStatus1 status;
+
+    unpackChanStatus (atomic_load_explicit (&syncIP->channels[channel].status, memory_order_acquire), &status);
+
+    for(int buffer = 0; buffer < syncIP->maxBuffers; ++buffer)
+    {
+      for(int user = 0; user < syncIP->maxUsers; ++user)
+        isAvailable = isAvailable && status.fbAvail[buffer][user];
+    }
+
+    while(isAvailable && !(reserved & BIT(channel)))
+    {
+      if (atomic_compare_exchange_weak_explicit (&syncIP->reservedChannels, &reserved, reserved | BIT(channel), memory_order_acq_rel, memory_order_acquire))
+        return channel;
+    }
+  }
+
+  xvfbsync_print ("No channel available");
+  return -1;
+}
+
+int xvfbsync_syncIP_populate (struct SyncIp1* syncIP, int fd)
+{
+  return xvfbsync_syncIP_populateWithOps (syncIP, fd, NULL, NULL);
+}
+
+int xvfbsync_syncIP_populateWithOps (struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque)
+{
+  return xvfbsync_syncIP_populateWithOptions (syncIP, fd, ops, opaque, NULL);
+}
+
+int xvfbsync_syncIP_populateWithOptions (struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque, const struct SyncIpOptions1* options)
+{
+  const struct SyncIpOptions1 defaultOptions = { THREADING_DEDICATED, 0, 0 };
+
+  if (!options)
+    options = &defaultOptions;
+
+  if (options->priority && (options->priority < sched_get_priority_min (SCHED_FIFO) || options->priority > sched_get_priority_max (SCHED_FIFO))) {
+    xvfbsync_print ("Invalid polling thread priority %d\n", options->priority);
+    return -1;
+  }
+
+  if (xvfbsync_syncIP_init (syncIP, fd, ops, opaque))
+    return -1;
+
+  syncIP->eThreading = options->eThreading;
+
+  /* the application polls the device itself */
+  if (syncIP->eThreading == THREADING_NONE)
+    return 0;
+
+  syncIP->quitFd = eventfd (0, EFD_CLOEXEC);
+
+  if (syncIP->quitFd == -1) {
+    xvfbsync_print ("Couldn't create the polling thread quit event\n");
+    goto fail_event;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+
+  if (options->cpuMask)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+
+    for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu)
+    {
+      if (options->cpuMask & (UINT64_C(1) << cpu))
+        CPU_SET (cpu, &cpus);
+    }
+
+    int ret = pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+
+    if (ret) {
+      xvfbsync_print ("Couldn't set the polling thread cpu mask 0x%" PRIx64 " (error: %d)\n", options->cpuMask, ret);
+      goto fail_attr;
+    }
+  }
+
+  if (options->priority)
+  {
+    struct sched_param param = { .sched_priority = options->priority };
+    int ret = pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+
+    if (ret) {
+      xvfbsync_print ("Couldn't set the polling thread explicit scheduling (error: %d)\n", ret);
+      goto fail_attr;
+    }
+
+    ret = pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+
+    if (ret) {
+      xvfbsync_print ("Couldn't set the polling thread SCHED_FIFO policy (error: %d)\n", ret);
+      goto fail_attr;
+    }
+
+    ret = pthread_attr_setschedparam (&attr, &param);
+
+    if (ret) {
+      xvfbsync_print ("Couldn't set the polling thread priority %d (error: %d)\n", options->priority, ret);
+      goto fail_attr;
+    }
+  }
+
+  struct ThreadInfo* tInfo = calloc (1, sizeof(struct ThreadInfo));
+  tInfo->syncIP = syncIP;
+
+  /* EPERM without the right to use real time priorities, EINVAL if none
+   * of the cpus is available */
+  int ret = pthread_create (&(syncIP->pollingThread), &attr, &xvfbsync_syncIP_pollingRoutine, tInfo);
+  pthread_attr_destroy (&attr);
+
+  if (ret) {
+    xvfbsync_print ("Couldn't create thread (error: %d)\n", ret);
+    free (tInfo);
+    goto fail_thread;
+  }
+
+  return 0;
+
+fail_attr:
+  pthread_attr_destroy (&attr);
+fail_thread:
+  close (syncIP->quitFd);
+fail_event:
+  xvfbsync_syncIP_deinit (syncIP);
+  return -1;
+}
+
+int xvfbsync_syncIP_processEvents (struct SyncIp1* syncIP, int timeout)
+{
+  if (syncIP->manager || syncIP->eThreading != THREADING_NONE) {
+    xvfbsync_print ("The events of the sync ip are handled by its own thread\n");
+    return -1;
+  }
+
+  /* there is no quit event, the quitFd entry (-1) is ignored by poll */
+  return xvfbsync_syncIP_pollErrors (syncIP, timeout) ? 0 : -1;
+}
+
+void xvfbsync_syncIP_depopulate (struct SyncIp1* syncIP)
+{
+  if (syncIP->manager) {
+    xvfbsync_manager_removeDevice (syncIP->manager, syncIP);
+    xvfbsync_syncIP_deinit (syncIP);
+    return;
+  }
+
+  if (syncIP->eThreading == THREADING_NONE) {
+    xvfbsync_syncIP_deinit (syncIP);
+    return;
+  }
+
+  uint64_t quit = 1;
+
+  if (write (syncIP->quitFd, &quit, sizeof (quit)) != sizeof (quit))
+    xvfbsync_print ("Couldn't wake up the polling thread\n");
+  pthread_join (syncIP->pollingThread, NULL);
+  close (syncIP->quitFd);
+  xvfbsync_syncIP_deinit (syncIP);
+}
+
+int xvfbsync_syncIP_getStatsFd (struct SyncIp1* syncIP)
+{
+  return syncIP->stats ? syncIP->statsFd : -1;
+}
+
+const struct StatsSegment1* xvfbsync_syncIP_getStats (struct SyncIp1* syncIP)
+{
+  return syncIP->stats;
+}
+
+int xvfbsync_syncIP_startRecording (struct SyncIp1* syncIP, const char* path)
+{
+  FILE* file = fopen (path, "wb");
+
+  if (!file) {
+    xvfbsync_print ("Couldn't open %s to record the ioctls (errno: %d)\n", path, errno);
+    return -1;
+  }
+
+  struct RecordHeader1 header;
+  header.magic = XVFBSYNC_RECORD_MAGIC;
+  header.version = XVFBSYNC_RECORD_VERSION;
+  header.encode = syncIP->encode;
+  header.maxChannels = syncIP->maxChannels;
+  header.startedAt = xvfbsync_now ();
+
+  if (fwrite (&header, sizeof (header), 1, file) != 1) {
+    xvfbsync_print ("Couldn't write the ioctl recording header\n");
+    fclose (file);
+    return -1;
+  }
+
+  pthread_mutex_lock (&syncIP->recordMutex);
+
+  if (syncIP->recordFile)
+    fclose (syncIP->recordFile);
+
+  syncIP->recordFile = file;
+  syncIP->recordStart = header.startedAt;
+  atomic_store_explicit (&syncIP->recording, true, memory_order_relaxed);
+  pthread_mutex_unlock (&syncIP->recordMutex);
+  return 0;
+}
+
+void xvfbsync_syncIP_stopRecording (struct SyncIp1* syncIP)
+{
+  pthread_mutex_lock (&syncIP->recordMutex);
+  atomic_store_explicit (&syncIP->recording, false, memory_order_relaxed);
+
+  if (syncIP->recordFile)
+    fclose (syncIP->recordFile);
+
+  syncIP->recordFile = NULL;
+  pthread_mutex_unlock (&syncIP->recordMutex);
+}
+
+/* Faster than recorded, the device may not have released the slot a config
+ * was programmed in yet: retry while it reports the channel busy, until the
+ * completions it had at record time happened */
+static int xvfbsync_syncIP_replayConfig (struct SyncIp1* syncIP, int chanId, struct xvsfsync_chan_config* config)
+{
+  uint64_t deadline = xvfbsync_now () + XVFBSYNC_REPLAY_PACING_NS;
+
+  for (;;)
+  {
+    /* only the last attempt counts as a failure */
+    bool last = xvfbsync_now () >= deadline;
+    int ret = xvfbsync_syncIP_ioctlTry (syncIP, chanId, XVSFSYNC_SET_CHAN_CONFIG, config, last);
+
+    if (!ret || errno != EBUSY || last)
+      return ret;
+
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = XVFBSYNC_REPLAY_RETRY_NS };
+    nanosleep (&ts, NULL);
+  }
+}
+
+int xvfbsync_syncIP_replay (struct SyncIp1* syncIP, const char* path, double speed)
+{
+  /* the recording holds the event thread ioctls too, a live one would
+   * issue them twice */
+  if (syncIP->manager || syncIP->eThreading != THREADING_NONE) {
+    xvfbsync_print ("Replay needs a sync ip populated with THREADING_NONE\n");
+    return -1;
+  }
+
+  FILE* file = fopen (path, "rb");
+
+  if (!file) {
+    xvfbsync_print ("Couldn't open the ioctl recording %s (errno: %d)\n", path, errno);
+    return -1;
+  }
+
+  struct RecordHeader1 header;
+
+  if (fread (&header, sizeof (header), 1, file) != 1 || header.magic != XVFBSYNC_RECORD_MAGIC || header.version != XVFBSYNC_RECORD_VERSION) {
+    xvfbsync_print ("%s isn't an ioctl recording this version can read\n", path);
+    fclose (file);
+    return -1;
+  }
+
+  union
+  {
+    struct xvsfsync_config config;
+    struct xvsfsync_stat stat;
+    struct xvsfsync_chan_config chanConfig;
+    struct xvsfsync_clr_err clrErr;
+    struct xvsfsync_fbdone fbdone;
+    struct xvsfsync_dma_info dmaInfo;
+  } arg;
+  struct RecordEntry1 entry;
+  uint64_t start = xvfbsync_now ();
+  int mismatches = 0;
+
+  while (fread (&entry, sizeof (entry), 1, file) == 1)
+  {
+    if (entry.argSize != xvfbsync_record_argSize (entry.request) || (entry.argSize && fread (&arg, entry.argSize, 1, file) != 1)) {
+      xvfbsync_print ("Truncated or corrupted ioctl recording %s\n", path);
+      mismatches = -1;
+      break;
+    }
+
+    if (entry.request == XVSFSYNC_GET_PHY_ADDR)
+      continue;
+
+    if (speed > 0)
+    {
+      uint64_t target = start + (uint64_t)(entry.timestamp / speed);
+      struct timespec ts = { .tv_sec = target / 1000000000, .tv_nsec = target % 1000000000 };
+
+      while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    }
+
+    void* argPtr = entry.argSize ? (void*)&arg : (void*)(uintptr_t)entry.argValue;
+    int ret;
+
+    if (entry.request == XVSFSYNC_SET_CHAN_CONFIG && !entry.result)
+      ret = xvfbsync_syncIP_replayConfig (syncIP, entry.chanId, &arg.chanConfig);
+    else
+      ret = xvfbsync_syncIP_ioctl (syncIP, entry.chanId, entry.request, argPtr);
+
+    if (ret != entry.result)
+      ++mismatches;
+  }
+
+  fclose (file);
+  return mismatches;
+}
+
+int xvfbsync_syncIP_getLatency (struct SyncIp1* syncIP, int chanId, ELatencyKind kind, struct LatencyHistogramSnapshot1* snapshot)
+{
+  if (chanId < 0 || chanId >= syncIP->maxChannels || kind < 0 || kind >= LATENCY_MAX_ENUM)
+    return -1;
+
+  struct LatencyHistogram1* histogram = &syncIP->channels[chanId].latency.histograms[kind];
+
+  for (int i = 0; i < XVFBSYNC_HISTOGRAM_BUCKETS; ++i)
+    snapshot->counts[i] = atomic_load_explicit (&histogram->counts[i], memory_order_relaxed);
+
+  snapshot->total = atomic_load_explicit (&histogram->total, memory_order_relaxed);
+  snapshot->sum = atomic_load_explicit (&histogram->sum, memory_order_relaxed);
+  snapshot->max = atomic_load_explicit (&histogram->max, memory_order_relaxed);
+  return 0;
+}
+
+void xvfbsync_syncIP_resetLatency (struct SyncIp1* syncIP, int chanId)
+{
+  if (chanId < 0 || chanId >= syncIP->maxChannels)
+    return;
+
+  for (int kind = 0; kind < LATENCY_MAX_ENUM; ++kind)
+    xvfbsync_histogram_reset (&syncIP->channels[chanId].latency.histograms[kind]);
+}
+
+uint64_t xvfbsync_latency_percentile (const struct LatencyHistogramSnapshot1* snapshot, double percentile)
+{
+  uint64_t total = 0;
+
+  for (int i = 0; i < XVFBSYNC_HISTOGRAM_BUCKETS; ++i)
+    total += snapshot->counts[i];
+
+  if (!total)
+    return 0;
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+  uint64_t seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (int i = 0; i < XVFBSYNC_HISTOGRAM_BUCKETS; ++i)
+  {
+    seen += snapshot->counts[i];
+
+    if (seen >= rank)
+      return MIN(xvfbsync_histogram_bucketMax (i), snapshot->max);
+  }
+
+  return snapshot->max;
+}
+
+int xvfbsync_syncIP_traceSnapshot (struct SyncIp1* syncIP, struct TraceEvent1* events, int maxEvents)
+{
+  if (!syncIP->traceSlots || maxEvents <= 0)
+    return 0;
+
+  uint64_t head = atomic_load_explicit (&syncIP->traceHead, memory_order_acquire);
+  uint64_t first = head > XVFBSYNC_TRACE_SIZE ? head - XVFBSYNC_TRACE_SIZE : 0;
+
+  if (head - first > (uint64_t)maxEvents)
+    first = head - maxEvents;
+
+  int numEvents = 0;
+
+  for (uint64_t idx = first; idx < head; ++idx)
+  {
+    struct TraceSlot1* slot = &syncIP->traceSlots[idx & (XVFBSYNC_TRACE_SIZE - 1)];
+    uint64_t seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+
+    /* still being written or already overwritten by a newer event */
+    if (seq != 2 * idx + 2)
+      continue;
+
+    struct TraceEvent1 event;
+    uint64_t argResult = atomic_load_explicit (&slot->argResult, memory_order_relaxed);
+    uint64_t durationTypeChannel = atomic_load_explicit (&slot->durationTypeChannel, memory_order_relaxed);
+    event.timestamp = atomic_load_explicit (&slot->timestamp, memory_order_relaxed);
+    event.arg = argResult >> 32;
+    event.result = (int32_t)(uint32_t)argResult;
+    event.duration = durationTypeChannel >> 32;
+    event.type = (uint16_t)(durationTypeChannel >> 16);
+    event.channel = (int16_t)(uint16_t)durationTypeChannel;
+    atomic_thread_fence (memory_order_acquire);
+
+    if (atomic_load_explicit (&slot->seq, memory_order_relaxed) != seq)
+      continue;
+
+    events[numEvents++] = event;
+  }
+
+  return numEvents;
+}
+
+void xvfbsync_syncIP_traceDump (struct SyncIp1* syncIP, FILE* out)
+{
+  struct TraceEvent1* events = calloc (XVFBSYNC_TRACE_SIZE, sizeof (struct TraceEvent1));
+
+  if (!events)
+    return;
+
+  int numEvents = xvfbsync_syncIP_traceSnapshot (syncIP, events, XVFBSYNC_TRACE_SIZE);
+
+  for (int i = 0; i < numEvents; ++i)
+  {
+    struct TraceEvent1* event = &events[i];
+    fprintf (out, "%" PRIu64 ".%09" PRIu64 " %-7s chan:%d arg:0x%" PRIx32 " result:%" PRId32 " duration:%" PRIu32 "ns\n",
+      event->timestamp / UINT64_C(1000000000), event->timestamp % UINT64_C(1000000000), xvfbsync_trace_eventName (event->type),
+      event->channel, event->arg, event->result, event->duration);
+  }
+
+  free (events);
+}
+
+/* *************** */
+/* xvfbsync dmabuf */
+/* *************** */
+
+/* A dmabuf is identified by its inode, so the same buffer imported again
+ * through another fd (e.g. passed between processes) still hits the cache.
+ * Called with the dmabuf lock held */
+static struct DmaBufCacheEntry1* xvfbsync_dmaBuf_find(struct SyncIp1* syncIP, dev_t dev, ino_t ino)
+{
+  for (int i = 0; i < XVFBSYNC_DMABUF_CACHE_SIZE; ++i)
+  {
+    struct DmaBufCacheEntry1* entry = &syncIP->dmaBufs[i];
+
+    if (entry->valid && entry->ino == ino && entry->dev == dev)
+      return entry;
+  }
+
+  return NULL;
+}
+
+int xvfbsync_syncIP_getDmaBufAddress(struct SyncIp1* syncIP, int dmaBufFd, uint32_t* phyAddr)
+{
+  struct stat st;
+
+  if (fstat (dmaBufFd, &st)) {
+    xvfbsync_print ("Couldn't stat dmabuf %d\n", dmaBufFd);
+    return -1;
+  }
+
+  pthread_mutex_lock (&syncIP->dmaBufMutex);
+  struct DmaBufCacheEntry1* entry = xvfbsync_dmaBuf_find (syncIP, st.st_dev, st.st_ino);
+
+  if (entry) {
+    *phyAddr = entry->phyAddr;
+    pthread_mutex_unlock (&syncIP->dmaBufMutex);
+    return 0;
+  }
+
+  pthread_mutex_unlock (&syncIP->dmaBufMutex);
+
+  struct xvsfsync_dma_info info;
+  info.fd = dmaBufFd;
+  info.phy_addr = 0;
+
+  if (xvfbsync_syncIP_ioctl (syncIP, -1, XVSFSYNC_GET_PHY_ADDR, &info)) {
+    xvfbsync_print ("Couldn't get the physical address of dmabuf %d\n", dmaBufFd);
+    return -1;
+  }
+
+  /* the oldest entry is replaced when the cache is full */
+  pthread_mutex_lock (&syncIP->dmaBufMutex);
+  entry = xvfbsync_dmaBuf_find (syncIP, st.st_dev, st.st_ino);
+
+  if (!entry) {
+    entry = &syncIP->dmaBufs[syncIP->dmaBufNext++ % XVFBSYNC_DMABUF_CACHE_SIZE];
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->valid = true;
+  }
+
+  entry->phyAddr = info.phy_addr;
+  pthread_mutex_unlock (&syncIP->dmaBufMutex);
+
+  *phyAddr = info.phy_addr;
+  return 0;
+}
+
+void xvfbsync_syncIP_forgetDmaBuf(struct SyncIp1* syncIP, int dmaBufFd)
+{
+  struct stat st;
+
+  if (fstat (dmaBufFd, &st))
+    return;
+
+  pthread_mutex_lock (&syncIP->dmaBufMutex);
+  struct DmaBufCacheEntry1* entry = xvfbsync_dmaBuf_find (syncIP, st.st_dev, st.st_ino);
+
+  if (entry)
+    entry->valid = false;
+
+  pthread_mutex_unlock (&syncIP->dmaBufMutex);
+}
+
+LLP2Buf* xvfbsync_syncIP_importDmaBuf(struct SyncIp1* syncIP, int dmaBufFd, uint32_t tFourCC, const struct TDimension* dim, const struct TPlane* planes, int numPlanes)
+{
+  uint32_t phyAddr;
+
+  if (numPlanes <= 0 || numPlanes > PLANE_MAX_ENUM) {
+    xvfbsync_print ("Invalid number of planes %d\n", numPlanes);
+    return NULL;
+  }
+
+  if (xvfbsync_syncIP_getDmaBufAddress (syncIP, dmaBufFd, &phyAddr))
+    return NULL;
+
+  LLP2Buf* buf = calloc (1, sizeof (LLP2Buf));
+
+  if (!buf) {
+    xvfbsync_print ("Couldn't allocate buffer\n");
+    return NULL;
+  }
+
+  buf->phyAddr = phyAddr;
+  buf->tFourCC = tFourCC;
+  buf->tDim = *dim;
+
+  for (int i = 0; i < numPlanes; ++i)
+    buf->tPlanes[i] = planes[i];
+
+  return buf;
+}
+
+/* ************************ */
+/* xvfbsync manager helpers */
+/* ************************ */
+
+/* Returns the index of syncIP in the manager, -1 if it isn't managed.
+ * Called with the manager mutex held */
+static int xvfbsync_manager_find(struct SyncIpManager1* manager, struct SyncIp1* syncIP)
+{
+  for (int i = 0; i < manager->numDevices; ++i)
+  {
+    if (manager->devices[i] == syncIP)
+      return i;
+  }
+
+  return -1;
+}
+
+static uint32_t xvfbsync_manager_epollEvents(struct SyncIp1* syncIP)
+{
+  return EPOLLPRI | (syncIP->trackFbDone ? EPOLLIN : 0);
+}
+
+/* epoll only says that the device needs attention, the device ops poll
+ * tells what happened (a stand-in device may only have a readable fd) */
+static void xvfbsync_manager_handleDevice(struct SyncIpManager1* manager, struct SyncIp1* syncIP, uint64_t key)
+{
+  struct pollfd fd;
+
+  fd.fd = syncIP->fd;
+  fd.events = POLLPRI | (syncIP->trackFbDone ? POLLIN : 0);
+  fd.revents = 0;
+
+  if (syncIP->ops->poll (syncIP->opsOpaque, &fd, 1, 0) <= 0)
+    return;
+
+  bool trackFbDone = syncIP->trackFbDone;
+
+  if (!xvfbsync_syncIP_handleEvents (syncIP, fd.revents)) {
+    epoll_ctl (manager->epollFd, EPOLL_CTL_DEL, syncIP->fd, NULL);
+    return;
+  }
+
+  /* stop waking up for completions the driver can't report */
+  if (trackFbDone && !syncIP->trackFbDone) {
+    struct epoll_event event = { .events = xvfbsync_manager_epollEvents (syncIP), .data.u64 = key };
+    epoll_ctl (manager->epollFd, EPOLL_CTL_MOD, syncIP->fd, &event);
+  }
+}
+
+static void* xvfbsync_manager_eventRoutine(void* arg)
+{
+  struct SyncIpManager1* manager = arg;
+  struct epoll_event events[2 * XVFBSYNC_MANAGER_MAX_DEVICES + 1];
+  struct SyncIp1* devices[XVFBSYNC_MANAGER_MAX_DEVICES];
+  uint64_t keys[XVFBSYNC_MANAGER_MAX_DEVICES];
+  bool ready[XVFBSYNC_MANAGER_MAX_DEVICES];
+  bool retried[XVFBSYNC_MANAGER_MAX_DEVICES];
+  bool quit = false;
+
+  while (!quit)
+  {
+    int timeout = -1;
+
+    /* wake up in time for the deferred channel restarts of every device */
+    pthread_mutex_lock (&manager->mutex);
+
+    for (int i = 0; i < manager->numDevices; ++i)
+      timeout = xvfbsync_timeout_min (timeout, xvfbsync_syncIP_retryTimeout (manager->devices[i]));
+
+    pthread_mutex_unlock (&manager->mutex);
+
+    int ret = epoll_wait (manager->epollFd, events, 2 * XVFBSYNC_MANAGER_MAX_DEVICES + 1, timeout);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      xvfbsync_print ("Error while waiting for sync ip events. (errno: %d)\n", errno);
+      break;
+    }
+
+    /* snapshot the devices and hold a reference on them: they are handled
+     * without the manager lock and removeDevice waits for the references to
+     * go away. An event whose key isn't managed anymore is stale (the keys
+     * aren't reused, so it can't be mistaken for a device added since) */
+    pthread_mutex_lock (&manager->mutex);
+
+    int numDevices = manager->numDevices;
+
+    for (int i = 0; i < numDevices; ++i)
+    {
+      devices[i] = manager->devices[i];
+      keys[i] = manager->keys[i];
+      ready[i] = false;
+      retried[i] = false;
+      ++devices[i]->managerRefs;
+    }
+
+    pthread_mutex_unlock (&manager->mutex);
+
+    for (int i = 0; i < ret; ++i)
+    {
+      if (!events[i].data.u64)
+        quit = true;
+
+      for (int j = 0; j < numDevices; ++j)
+      {
+        if (keys[j] == events[i].data.u64)
+          ready[j] = true;
+
+        if ((keys[j] | XVFBSYNC_MANAGER_RETRY_KEY) == events[i].data.u64)
+          retried[j] = true;
+      }
+    }
+
+    for (int i = 0; i < numDevices; ++i)
+    {
+      if (ready[i])
+        xvfbsync_manager_handleDevice (manager, devices[i], keys[i]);
+
+      if (retried[i])
+        xvfbsync_syncIP_clearRetryFd (devices[i]);
+    }
+
+    for (int i = 0; i < numDevices; ++i)
+      xvfbsync_syncIP_runRetries (devices[i]);
+
+    pthread_mutex_lock (&manager->mutex);
+
+    for (int i = 0; i < numDevices; ++i)
+      --devices[i]->managerRefs;
+
+    pthread_cond_broadcast (&manager->dispatched);
+    pthread_mutex_unlock (&manager->mutex);
+  }
+
+  return NULL;
+}
+
+/* **************** */
+/* xvfbsync manager */
+/* **************** */
+
+int xvfbsync_manager_populate(struct SyncIpManager1* manager)
+{
+  memset (manager, 0, sizeof (*manager));
+  pthread_mutex_init (&manager->mutex, NULL);
+  pthread_cond_init (&manager->dispatched, NULL);
+
+  manager->epollFd = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (manager->epollFd == -1) {
+    xvfbsync_print ("Couldn't create the sync ip event set\n");
+    goto fail_epoll;
+  }
+
+  manager->quitFd = eventfd (0, EFD_CLOEXEC);
+
+  if (manager->quitFd == -1) {
+    xvfbsync_print ("Couldn't create the event thread quit event\n");
+    goto fail_event;
+  }
+
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = 0 };
+
+  if (epoll_ctl (manager->epollFd, EPOLL_CTL_ADD, manager->quitFd, &event)) {
+    xvfbsync_print ("Couldn't watch the event thread quit event\n");
+    goto fail_thread;
+  }
+
+  if (pthread_create (&manager->eventThread, NULL, &xvfbsync_manager_eventRoutine, manager)) {
+    xvfbsync_print ("Couldn't create thread");
+    goto fail_thread;
+  }
+
+  return 0;
+
+fail_thread:
+  close (manager->quitFd);
+fail_event:
+  close (manager->epollFd);
+fail_epoll:
+  pthread_cond_destroy (&manager->dispatched);
+  pthread_mutex_destroy (&manager->mutex);
+  return -1;
+}
+
+void xvfbsync_manager_depopulate(struct SyncIpManager1* manager)
+{
+  uint64_t quit = 1;
+
+  if (write (manager->quitFd, &quit, sizeof (quit)) != sizeof (quit))
+    xvfbsync_print ("Couldn't wake up the event thread\n");
+  pthread_join (manager->eventThread, NULL);
+
+  while (manager->numDevices > 0)
+  {
+    struct SyncIp1* syncIP = manager->devices[manager->numDevices - 1];
+    bool owned = manager->ownsDevice[manager->numDevices - 1];
+    int fd = syncIP->fd;
+
+    xvfbsync_syncIP_depopulate (syncIP);
+
+    if (owned) {
+      close (fd);
+      free (syncIP);
+    }
+  }
+
+  close (manager->quitFd);
+  close (manager->epollFd);
+  pthread_cond_destroy (&manager->dispatched);
+  pthread_mutex_destroy (&manager->mutex);
+}
+
+int xvfbsync_manager_addDevice(struct SyncIpManager1* manager, struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque)
+{
+  if (manager->numDevices >= XVFBSYNC_MANAGER_MAX_DEVICES) {
+    xvfbsync_print ("Too many sync ips\n");
+    return -1;
+  }
+
+  if (xvfbsync_syncIP_init (syncIP, fd, ops, opaque))
+    return -1;
+
+  pthread_mutex_lock (&manager->mutex);
+
+  uint64_t key = ++manager->nextKey;
+  struct epoll_event event = { .events = xvfbsync_manager_epollEvents (syncIP), .data.u64 = key };
+  struct epoll_event retryEvent = { .events = EPOLLIN, .data.u64 = key | XVFBSYNC_MANAGER_RETRY_KEY };
+  bool watched = manager->numDevices < XVFBSYNC_MANAGER_MAX_DEVICES && !epoll_ctl (manager->epollFd, EPOLL_CTL_ADD, fd, &event);
+
+  if (watched && epoll_ctl (manager->epollFd, EPOLL_CTL_ADD, syncIP->retryFd, &retryEvent)) {
+    epoll_ctl (manager->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    watched = false;
+  }
+
+  if (!watched) {
+    pthread_mutex_unlock (&manager->mutex);
+    xvfbsync_print ("Couldn't watch the sync ip events\n");
+    xvfbsync_syncIP_deinit (syncIP);
+    return -1;
+  }
+
+  syncIP->manager = manager;
+  syncIP->managerRefs = 0;
+  manager->ownsDevice[manager->numDevices] = false;
+  manager->keys[manager->numDevices] = key;
+  manager->devices[manager->numDevices++] = syncIP;
+  pthread_mutex_unlock (&manager->mutex);
+  return 0;
+}
+
+void xvfbsync_manager_removeDevice(struct SyncIpManager1* manager, struct SyncIp1* syncIP)
+{
+  pthread_mutex_lock (&manager->mutex);
+
+  int index = xvfbsync_manager_find (manager, syncIP);
+
+  if (index != -1) {
+    epoll_ctl (manager->epollFd, EPOLL_CTL_DEL, syncIP->fd, NULL);
+    epoll_ctl (manager->epollFd, EPOLL_CTL_DEL, syncIP->retryFd, NULL);
+
+    for (int i = index; i < manager->numDevices - 1; ++i)
+    {
+      manager->devices[i] = manager->devices[i + 1];
+      manager->ownsDevice[i] = manager->ownsDevice[i + 1];
+      manager->keys[i] = manager->keys[i + 1];
+    }
+
+    --manager->numDevices;
+  }
+
+  /* the event thread may still be handling it from its snapshot */
+  while (syncIP->managerRefs > 0)
+    pthread_cond_wait (&manager->dispatched, &manager->mutex);
+
+  syncIP->manager = NULL;
+  pthread_mutex_unlock (&manager->mutex);
+}
+
+int xvfbsync_manager_discover(struct SyncIpManager1* manager, const char* pattern)
+{
+  glob_t paths;
+  int added = 0;
+
+  if (glob (pattern ? pattern : XVFBSYNC_MANAGER_DEFAULT_PATTERN, 0, NULL, &paths))
+    return 0;
+
+  for (size_t i = 0; i < paths.gl_pathc; ++i)
+  {
+    int fd = open (paths.gl_pathv[i], O_RDWR | O_CLOEXEC);
+
+    if (fd == -1) {
+      xvfbsync_print ("Couldn't open %s\n", paths.gl_pathv[i]);
+      continue;
+    }
+
+    struct SyncIp1* syncIP = calloc (1, sizeof (struct SyncIp1));
+
+    if (!syncIP || xvfbsync_manager_addDevice (manager, syncIP, fd, NULL, NULL)) {
+      free (syncIP);
+      close (fd);
+      continue;
+    }
+
+    pthread_mutex_lock (&manager->mutex);
+    manager->ownsDevice[xvfbsync_manager_find (manager, syncIP)] = true;
+    pthread_mutex_unlock (&manager->mutex);
+    ++added;
+  }
+
+  globfree (&paths);
+  return added;
+}
+
+int xvfbsync_manager_getDeviceCount(struct SyncIpManager1* manager)
+{
+  pthread_mutex_lock (&manager->mutex);
+  int numDevices = manager->numDevices;
+  pthread_mutex_unlock (&manager->mutex);
+  return numDevices;
+}
+
+struct SyncIp1* xvfbsync_manager_getDevice(struct SyncIpManager1* manager, int index)
+{
+  struct SyncIp1* syncIP = NULL;
+
+  pthread_mutex_lock (&manager->mutex);
+
+  if (index >= 0 && index < manager->numDevices)
+    syncIP = manager->devices[index];
+
+  pthread_mutex_unlock (&manager->mutex);
+  return syncIP;
+}
+
+int xvfbsync_manager_getFreeChannel(struct SyncIpManager1* manager, bool encode, struct SyncIp1** syncIP)
+{
+  pthread_mutex_lock (&manager->mutex);
+
+  for (int i = 0; i < manager->numDevices; ++i)
+  {
+    if (manager->devices[i]->encode != encode)
+      continue;
+
+    int chanId = xvfbsync_syncIP_getFreeChannel (manager->devices[i]);
+
+    if (chanId != -1) {
+      *syncIP = manager->devices[i];
+      pthread_mutex_unlock (&manager->mutex);
+      return chanId;
+    }
+  }
+
+  pthread_mutex_unlock (&manager->mutex);
+  return -1;
+}
+
+/* ************************* */
+/* xvfbsync syncChan helpers */
+/* ************************* */
+
+static const TFourCCMapping FourCCMappings[] =
+{
+  // planar: 8b
+  FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '4', '2', '0'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_U_V, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', 'Y', 'U', 'V'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_U_V, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', 'V', '1', '2'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_V_U, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '4', '2', '2'), CHROMA_4_2_2, 8, FB_RASTER, C_ORDER_U_V, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', 'V', '1', '6'), CHROMA_4_2_2, 8, FB_RASTER, C_ORDER_U_V, false, false)
+  // planar: 10b
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '0', 'A', 'L'), CHROMA_4_2_0, 10, FB_RASTER, C_ORDER_U_V, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('I', '2', 'A', 'L'), CHROMA_4_2_2, 10, FB_RASTER, C_ORDER_U_V, false, false)
+
+  // semi-planar: 8b
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('N', 'V', '1', '2'), CHROMA_4_2_0, 8, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('N', 'V', '1', '6'), CHROMA_4_2_2, 8, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
+  // semi-planar: 10b
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('P', '0', '1', '0'), CHROMA_4_2_0, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('P', '2', '1', '0'), CHROMA_4_2_2, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, false)
+
+  // monochrome
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', '8', '0', '0'), CHROMA_4_0_0, 8, FB_RASTER, C_ORDER_NO_CHROMA, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('Y', '0', '1', '0'), CHROMA_4_0_0, 10, FB_RASTER, C_ORDER_NO_CHROMA, false, false)
+
+  // tile : 64x4
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '0', '8'), CHROMA_4_2_0, 8, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '2', '8'), CHROMA_4_2_2, 8, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', 'm', '8'), CHROMA_4_0_0, 8, FB_TILE_64x4, C_ORDER_NO_CHROMA, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '0', 'A'), CHROMA_4_2_0, 10, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', '2', 'A'), CHROMA_4_2_2, 10, FB_TILE_64x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '6', 'm', 'A'), CHROMA_4_0_0, 10, FB_TILE_64x4, C_ORDER_NO_CHROMA, false, false)
+  // tile : 32x4
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '0', '8'), CHROMA_4_2_0, 8, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '2', '8'), CHROMA_4_2_2, 8, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', 'm', '8'), CHROMA_4_0_0, 8, FB_TILE_32x4, C_ORDER_NO_CHROMA, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '0', 'A'), CHROMA_4_2_0, 10, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', '2', 'A'), CHROMA_4_2_2, 10, FB_TILE_32x4, C_ORDER_SEMIPLANAR, false, false)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('T', '5', 'm', 'A'), CHROMA_4_0_0, 10, FB_TILE_32x4, C_ORDER_NO_CHROMA, false, false)
+
+
+  // 10b packed
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('X', 'V', '1', '0'), CHROMA_4_0_0, 10, FB_RASTER, C_ORDER_NO_CHROMA, false, true)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('X', 'V', '1', '5'), CHROMA_4_2_0, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, true)
+  , FOURCC_MAPPING(XVFBSYNC_FOURCC2('X', 'V', '2', '0'), CHROMA_4_2_2, 10, FB_RASTER, C_ORDER_SEMIPLANAR, false, true)
+};
+
+static const int FourCCMappingSize = sizeof(FourCCMappings) / sizeof(FourCCMappings[0]);
+
+
+/* FourCC -> format descriptor hash table, built once from FourCCMappings.
+ * Open addressing with linear probing, the table is kept at most half full */
+#define FORMAT_HASH_BITS 6
+#define FORMAT_HASH_SIZE (1 << FORMAT_HASH_BITS)
+
+/* Access unit of the hardware for each storage mode: tiled planes are
+ * read and written by whole tiles of iWidth x iHeight pixels */
+static const struct
+{
+  int iWidth;
+  int iHeight;
+} StorageProfiles[FB_MAX_ENUM] =
+{
+  [FB_RASTER] = { 1, 1 },
+  [FB_TILE_32x4] = { 32, 4 },
+  [FB_TILE_64x4] = { 64, 4 },
+};
+
+static TFormatDesc FormatDescs[sizeof(FourCCMappings) / sizeof(FourCCMappings[0])];
+static int8_t FormatHash[FORMAT_HASH_SIZE];
+static pthread_once_t FormatHashOnce = PTHREAD_ONCE_INIT;
+
+static unsigned int xvfbsync_format_hash (uint32_t tFourCC)
+{
+  return (tFourCC * 0x9E3779B1u) >> (32 - FORMAT_HASH_BITS);
+}
+
+static void xvfbsync_format_initHash (void)
+{
+  assert (2 * FourCCMappingSize <= FORMAT_HASH_SIZE);
+
+  for (int i = 0; i < FORMAT_HASH_SIZE; ++i)
+    FormatHash[i] = -1;
+
+  for (int i = 0; i < FourCCMappingSize; ++i)
+  {
+    const TPicFormat* tPicFormat = &FourCCMappings[i].tPictFormat;
+    TFormatDesc* desc = &FormatDescs[i];
+
+    desc->tFourCC = FourCCMappings[i].tfourCC;
+    desc->tPicFormat = *tPicFormat;
+    desc->bMonochrome = tPicFormat->eChromaMode == CHROMA_MONO;
+    desc->bSemiPlanar = tPicFormat->eChromaOrder == C_ORDER_SEMIPLANAR;
+    desc->bTiled = tPicFormat->eStorageMode != FB_RASTER;
+    desc->iChromaPlanes = desc->bMonochrome ? 0 : desc->bSemiPlanar ? 1 : 2;
+    desc->iVerticalFactor = (tPicFormat->eChromaMode == CHROMA_4_2_0) ? 2 : 1;
+    desc->iTileWidth = StorageProfiles[tPicFormat->eStorageMode].iWidth;
+    desc->iTileHeight = StorageProfiles[tPicFormat->eStorageMode].iHeight;
+    desc->iTileBytes = desc->iTileWidth * desc->iTileHeight * tPicFormat->uBitDepth / 8;
+
+    unsigned int slot = xvfbsync_format_hash (desc->tFourCC);
+
+    while (FormatHash[slot] != -1)
+      slot = (slot + 1) & (FORMAT_HASH_SIZE - 1);
+
+    FormatHash[slot] = i;
+  }
+}
+
+/* Returns NULL if the fourcc isn't supported */
+static const TFormatDesc* xvfbsync_format_lookup (uint32_t tFourCC)
+{
+  pthread_once (&FormatHashOnce, &xvfbsync_format_initHash);
+
+  for (unsigned int slot = xvfbsync_format_hash (tFourCC); FormatHash[slot] != -1; slot = (slot + 1) & (FORMAT_HASH_SIZE - 1))
+  {
+    if (FormatDescs[(int)FormatHash[slot]].tFourCC == tFourCC)
+      return &FormatDescs[(int)FormatHash[slot]];
+  }
+
+  return NULL;
+}
+
+static bool GetPicFormat(uint32_t tFourCC, TPicFormat* tPicFormat)
+{
+  const TFormatDesc* desc = xvfbsync_format_lookup (tFourCC);
+
+  if (desc)
+  {
+    *tPicFormat = desc->tPicFormat;
+    return true;
+  }
+
+  assert(0);
+
+  return false;
+}
+
+
+bool IsTiled(uint32_t tFourCC)
+{
+  TPicFormat tPicFormat;
+  return GetPicFormat(tFourCC, &tPicFormat) && (tPicFormat.eStorageMode != FB_RASTER);
+}
+
+EChromaMode GetChromaMode(uint32_t tFourCC)
+{
+  TPicFormat tPicFormat;
+  return GetPicFormat(tFourCC, &tPicFormat) ? tPicFormat.eChromaMode : (EChromaMode) - 1;
+}
+
+bool IsSemiPlanar(uint32_t tFourCC)
+{
+  TPicFormat tPicFormat;
+  return GetPicFormat(tFourCC, &tPicFormat) && (tPicFormat.eChromaOrder == C_ORDER_SEMIPLANAR);
+}
+
+bool IsMonochrome(uint32_t tFourCC)
+{
+  return GetChromaMode(tFourCC) == CHROMA_MONO;
+}
+
+static int RoundUp (int iVal, int iRnd)
+{
+  assert ((iRnd % 2) == 0);
+  return (iVal + iRnd - 1) / iRnd * iRnd;
+}
+ 
+static void printFrameBufferConfig(struct xvsfsync_chan_config* config, int maxUsers, int maxCores)
+{
+  printf ("********************************\n");
+  printf ("channel_id:%d\n", config->channel_id);
+  printf ("luma_margin:%d\n", config->luma_margin);
+  printf ("chroma_margin:%d\n", config->chroma_margin);
+
+  for (int user = 0; user < maxUsers; ++user)
+  {
+    printf ("%s[%d]:\n", (user == XVSFSYNC_PROD) ? "prod" : (user == XVSFSYNC_CONS) ? "cons" : "unknown", user);
+    printf ("\t-fb_id:%d %s\n", config->fb_id[user], config->fb_id[user] == XVSFSYNC_AUTO_SEARCH ? "(auto_search)" : "");
+    printf ("\t-ismono:%s\n", (config->ismono[user] == 0) ? "false" : "true");
+    printf ("\t-luma_start_address:%" PRIx64 "\n", config->luma_start_address[user]);
+    printf ("\t-luma_end_address:%" PRIx64 "\n", config->luma_end_address[user]);
+    printf ("\t-chroma_start_address:%" PRIx64 "\n", config->chroma_start_address[user]);
+    printf ("\t-chroma_end_address:%" PRIx64 "\n", config->chroma_end_address[user]);
+  }
+
+  for (int core = 0; core < maxCores; ++core)
+  {
+    printf ("core[%i]:\n", core);
+    printf ("\t-luma_core_offset:%d\n", config->luma_core_offset[core]);
+    printf ("\t-chroma_core_offset:%d\n", config->chroma_core_offset[core]);
+  }
+
+  printf ("********************************\n");
+}
+
+static int xvsfsync_chan_getChromaSize(LLP2Buf* buf, const TFormatDesc* desc)
+{
+  if(desc->bMonochrome)
+    return 0;
+
+  int const iHeightC = buf->tDim.iHeight / desc->iVerticalFactor;
+
+  if(desc->bTiled)
     return buf->tPlanes[PLANE_UV].iPitch * iHeightC / 4;
 
-  if(IsSemiPlanar(buf->tFourCC))
-    return buf->tPlanes[PLANE_UV].iPitch * iHeightC;
+  if(desc->bSemiPlanar)
+    return buf->tPlanes[PLANE_UV].iPitch * iHeightC;
+
+  return buf->tPlanes[PLANE_UV].iPitch * iHeightC * 2;
+}
+
+/* Width of the chroma lines: U and V are interleaved on the luma width in
+ * semi-planar formats, planar formats have half width U and V planes */
+static int xvsfsync_chan_getChromaWidth(LLP2Buf* buf, const TFormatDesc* desc)
+{
+  if(desc->bSemiPlanar)
+    return buf->tDim.iWidth;
+  return buf->tDim.iWidth / 2;
+}
+
+/* Planar buffers store their second chroma plane right after the first one
+ * with the same pitch, PLANE_UV describes the plane that comes first in
+ * memory (V for the C_ORDER_V_U formats such as YV12), so the chroma range
+ * covers both planes whatever their order */
+static int xvsfsync_chan_getOffsetUV(LLP2Buf* buf, const TFormatDesc* desc)
+{
+  assert(buf->tPlanes[PLANE_Y].iPitch * buf->tDim.iHeight <= buf->tPlanes[PLANE_UV].iOffset ||
+         (desc->bTiled &&
+          (buf->tPlanes[PLANE_Y].iPitch * buf->tDim.iHeight / 4 <= buf->tPlanes[PLANE_UV].iOffset)));
+  return buf->tPlanes[PLANE_UV].iOffset;
+}
+
+/* Offset of pixel x from the start of its line (or of its tile row),
+ * x is a multiple of the tile width in tiled planes */
+static int xvsfsync_chan_getLineBytes(const TFormatDesc* desc, int x)
+{
+  if(desc->bTiled)
+    return x / desc->iTileWidth * desc->iTileBytes;
+
+  if(desc->tPicFormat.b10bPacked)
+    return x / 3 * 4; /* 3 pixels per 32 bits word */
+
+  if(desc->tPicFormat.uBitDepth > 8)
+    return x * 2;
+
+  return x;
+}
+
+/* Bytes the hardware accesses to cover the first width pixels of a line
+ * (or of a tile row) */
+static int xvsfsync_chan_getLineSize(const TFormatDesc* desc, int width)
+{
+  if(desc->bTiled)
+    return (width + desc->iTileWidth - 1) / desc->iTileWidth * desc->iTileBytes;
+
+  if(desc->tPicFormat.b10bPacked)
+    return (width + 2) / 3 * 4;
+
+  return xvsfsync_chan_getLineBytes (desc, width);
+}
+
+/* Offset of the first line y of a plane, tiled planes store a tile row
+ * per pitch */
+static int xvsfsync_chan_getLineOffset(const TFormatDesc* desc, int pitch, int y)
+{
+  return y / desc->iTileHeight * pitch;
+}
+
+/* Offset from the plane start of the last byte of its first width x height
+ * pixels, as the hardware accesses them: whole tiles in tiled planes,
+ * raster lines rounded up to iLineAlignment bytes.
+ *           <------------> stride
+ *           <--------> width
+ * height   ^
+ *          |
+ *          |
+ *          v         x last pixel of the image
+ * end = (height - 1) * stride + width - 1 (to get the last pixel of the image)
+ */
+static int xvsfsync_chan_getPlaneEnd(const TFormatDesc* desc, int pitch, int width, int height, int iLineAlignment)
+{
+  int iLineSize = xvsfsync_chan_getLineSize (desc, width);
+  int iLines = (height + desc->iTileHeight - 1) / desc->iTileHeight;
+
+  if(!desc->bTiled && iLineAlignment > 1)
+    iLineSize = RoundUp(iLineSize, iLineAlignment);
+
+  return (iLines - 1) * pitch + iLineSize - 1;
+}
+
+/* Each core handles a region of the frame (a column of LCUs or a band of
+ * lines), its offset is the distance from the plane start to the first
+ * pixel of its region, so the consumer core can start as soon as the
+ * producer wrote that region */
+static void setCoreOffsets(struct xvsfsync_chan_config* config, LLP2Buf* buf, const TFormatDesc* desc, const struct CoreSplit1* split)
+{
+  for(int core = 0; core < XVSFSYNC_MAX_CORES; core++)
+  {
+    config->luma_core_offset[core] = 0;
+    config->chroma_core_offset[core] = 0;
+  }
+
+  if(!split || split->numCores <= 1)
+    return;
+
+  int const iSize = split->ePartition == CORE_PARTITION_COLUMNS ? buf->tDim.iWidth : buf->tDim.iHeight;
+  int const iNumUnits = (iSize + split->iUnitSize - 1) / split->iUnitSize;
+
+  for(int core = 1; core < split->numCores; core++)
+  {
+    /* the units are spread evenly, the first cores get the smaller regions */
+    int iStart = core * iNumUnits / split->numCores * split->iUnitSize;
+
+    if(split->ePartition == CORE_PARTITION_COLUMNS)
+    {
+      int iLineBytes = xvsfsync_chan_getLineBytes (desc, iStart);
+
+      config->luma_core_offset[core] = iLineBytes;
+
+      /* interleaved U and V take the bytes of the luma, planar chroma half */
+      if(!desc->bMonochrome)
+        config->chroma_core_offset[core] = desc->bSemiPlanar ? iLineBytes : iLineBytes / 2;
+    }
+    else
+    {
+      config->luma_core_offset[core] = xvsfsync_chan_getLineOffset (desc, buf->tPlanes[PLANE_Y].iPitch, iStart);
+
+      if(!desc->bMonochrome)
+        config->chroma_core_offset[core] = xvsfsync_chan_getLineOffset (desc, buf->tPlanes[PLANE_UV].iPitch, iStart / desc->iVerticalFactor);
+    }
+  }
+}
+
+static struct xvsfsync_chan_config setEncFrameBufferConfig(int channelId, LLP2Buf* buf, const TFormatDesc* desc, int hardwareHorizontalStrideAlignment, int hardwareVerticalStrideAlignment, const struct CoreSplit1* split)
+{
+  uint32_t physical = buf->phyAddr;
+
+  struct xvsfsync_chan_config config;
+
+  config.luma_start_address[XVSFSYNC_PROD] = physical + buf->tPlanes[PLANE_Y].iOffset;
+  config.luma_end_address[XVSFSYNC_PROD] = config.luma_start_address[XVSFSYNC_PROD] + xvsfsync_chan_getPlaneEnd (desc, buf->tPlanes[PLANE_Y].iPitch, buf->tDim.iWidth, buf->tDim.iHeight, 1);
+
+  /* the encoder reads raster lines by hardware aligned chunks of bytes over
+   * hardware aligned lines, tiled planes are read by whole tiles */
+  config.luma_start_address[XVSFSYNC_CONS] = physical + buf->tPlanes[PLANE_Y].iOffset;
+  int iHardwarePitch = desc->bTiled ? buf->tPlanes[PLANE_Y].iPitch : RoundUp(buf->tPlanes[PLANE_Y].iPitch, hardwareHorizontalStrideAlignment);
+  int iHardwareLumaVerticalPitch = RoundUp(buf->tDim.iHeight, hardwareVerticalStrideAlignment);
+  config.luma_end_address[XVSFSYNC_CONS] = config.luma_start_address[XVSFSYNC_CONS] + xvsfsync_chan_getPlaneEnd (desc, iHardwarePitch, buf->tDim.iWidth, iHardwareLumaVerticalPitch, hardwareHorizontalStrideAlignment);
+
+  /* chroma is the same, but the width depends on the format of the yuv.
+   * Planar formats end on the last line of their second chroma plane */
+  if(!desc->bMonochrome)
+  {
+    int iChromaWidth = xvsfsync_chan_getChromaWidth (buf, desc);
+    int iChromaHeight = buf->tDim.iHeight / desc->iVerticalFactor;
+    int iFirstPlanesSize = desc->bSemiPlanar ? 0 : xvsfsync_chan_getChromaSize (buf, desc) / desc->iChromaPlanes;
+    config.chroma_start_address[XVSFSYNC_PROD] = physical + xvsfsync_chan_getOffsetUV (buf, desc);
+    config.chroma_end_address[XVSFSYNC_PROD] = config.chroma_start_address[XVSFSYNC_PROD] + iFirstPlanesSize + xvsfsync_chan_getPlaneEnd (desc, buf->tPlanes[PLANE_UV].iPitch, iChromaWidth, iChromaHeight, 1);
+    config.chroma_start_address[XVSFSYNC_CONS] = physical + xvsfsync_chan_getOffsetUV (buf, desc);
+    int iVerticalFactor = desc->iVerticalFactor;
+    int iHardwareChromaVerticalPitch = RoundUp(iChromaHeight, (hardwareVerticalStrideAlignment / iVerticalFactor));
+    int iHardwareChromaPitch = desc->bSemiPlanar ? iHardwarePitch : RoundUp(buf->tPlanes[PLANE_UV].iPitch, hardwareHorizontalStrideAlignment);
+    config.chroma_end_address[XVSFSYNC_CONS] = config.chroma_start_address[XVSFSYNC_CONS] + iFirstPlanesSize + xvsfsync_chan_getPlaneEnd (desc, iHardwareChromaPitch, iChromaWidth, iHardwareChromaVerticalPitch, hardwareHorizontalStrideAlignment);
+
+    for(int user = 0; user < XVSFSYNC_IO; user++)
+      config.ismono[user] = 0;
+  }
+  else
+  {
+    for(int user = 0; user < XVSFSYNC_IO; user++)
+    {
+      config.chroma_start_address[user] = 0;
+      config.chroma_end_address[user] = 0;
+      config.ismono[user] = 1;
+    }
+  }
+
+  setCoreOffsets (&config, buf, desc, split);
+
+  /* no margin for now (only needed for the decoder) */
+  config.luma_margin = 0;
+  config.chroma_margin = 0;
+
+  config.fb_id[XVSFSYNC_PROD] = XVSFSYNC_AUTO_SEARCH;
+  config.fb_id[XVSFSYNC_CONS] = XVSFSYNC_AUTO_SEARCH;
+  config.channel_id = channelId;
+
+  return config;
+}
+
+static struct xvsfsync_chan_config setDecFrameBufferConfig(int channelId, LLP2Buf* buf, const TFormatDesc* desc, const struct CoreSplit1* split, int lcuSize)
+{
+  uint32_t physical = buf->phyAddr;
+
+  struct xvsfsync_chan_config config;
+
+  /* the decoder writes whole LCU rows by 64 bytes bursts */
+  int iProducerHeight = lcuSize ? RoundUp(buf->tDim.iHeight, lcuSize) : buf->tDim.iHeight;
+  int iProducerAlignment = lcuSize ? 64 : 1;
+
+  config.luma_start_address[XVSFSYNC_PROD] = physical + buf->tPlanes[PLANE_Y].iOffset;
+  config.luma_end_address[XVSFSYNC_PROD] = config.luma_start_address[XVSFSYNC_PROD] + xvsfsync_chan_getPlaneEnd (desc, buf->tPlanes[PLANE_Y].iPitch, buf->tDim.iWidth, iProducerHeight, iProducerAlignment);
+  config.luma_start_address[XVSFSYNC_CONS] = physical + buf->tPlanes[PLANE_Y].iOffset;
+  config.luma_end_address[XVSFSYNC_CONS] = config.luma_start_address[XVSFSYNC_CONS] + xvsfsync_chan_getPlaneEnd (desc, buf->tPlanes[PLANE_Y].iPitch, buf->tDim.iWidth, buf->tDim.iHeight, 1);
+
+  /* chroma is the same, but the width depends on the format of the yuv.
+   * Planar formats end on the last line of their second chroma plane */
+  if(!desc->bMonochrome)
+  {
+    int iChromaWidth = xvsfsync_chan_getChromaWidth (buf, desc);
+    int iChromaHeight = buf->tDim.iHeight / desc->iVerticalFactor;
+    int iFirstPlanesSize = desc->bSemiPlanar ? 0 : xvsfsync_chan_getChromaSize (buf, desc) / desc->iChromaPlanes;
+    config.chroma_start_address[XVSFSYNC_PROD] = physical + xvsfsync_chan_getOffsetUV (buf, desc);
+    config.chroma_end_address[XVSFSYNC_PROD] = config.chroma_start_address[XVSFSYNC_PROD] + iFirstPlanesSize + xvsfsync_chan_getPlaneEnd (desc, buf->tPlanes[PLANE_UV].iPitch, iChromaWidth, iProducerHeight / desc->iVerticalFactor, iProducerAlignment);
+    config.chroma_start_address[XVSFSYNC_CONS] = physical + xvsfsync_chan_getOffsetUV (buf, desc);
+    config.chroma_end_address[XVSFSYNC_CONS] = config.chroma_start_address[XVSFSYNC_CONS] + iFirstPlanesSize + xvsfsync_chan_getPlaneEnd (desc, buf->tPlanes[PLANE_UV].iPitch, iChromaWidth, iChromaHeight, 1);
+
+    for(int user = 0; user < XVSFSYNC_IO; user++)
+      config.ismono[user] = 0;
+  }
+  else
+  {
+    for(int user = 0; user < XVSFSYNC_IO; user++)
+    {
+      config.chroma_start_address[user] = 0;
+      config.chroma_end_address[user] = 0;
+      config.ismono[user] = 1;
+    }
+  }
+
+  setCoreOffsets (&config, buf, desc, split);
+
+  /* the margins are set when the buffer is programmed, they can change
+   * while it waits in the queue */
+  config.luma_margin = 0;
+  config.chroma_margin = 0;
+
+  config.fb_id[XVSFSYNC_PROD] = XVSFSYNC_AUTO_SEARCH;
+  config.fb_id[XVSFSYNC_CONS] = XVSFSYNC_AUTO_SEARCH;
+  config.channel_id = channelId;
+
+  return config;
+}
+
+static void xvfbsync_syncChan_listener (struct ChannelStatus1* status)
+{
+  xvfbsync_print ("watchdog: %d, sync: %d, ldiff: %d, cdiff: %d\n", status->watchdogError, status->syncError, status->lumaDiffError, status->chromaDiffError);
+}
+
+static void xvfbsync_syncChan_disable (struct SyncChannel1* syncChan)
+{
+  if (!syncChan->enabled)
+    assert (0 == "Tried to disable a channel twice");
+
+  xvfbsync_syncIP_disableChannel (syncChan->sync, syncChan->id);
+  syncChan->enabled = false;
+  /* a pending restart would enable it back */
+  syncChan->restartAt = 0;
+  xvfbsync_print ("Disable channel %d\n", syncChan->id);
+}
+
+/* ***************** */
+/* xvfbsync syncChan */
+/* ***************** */
+
+static int xvfbsync_syncChan_populate (struct SyncChannel1* syncChan, struct SyncIp1* syncIP, int id)
+{
+  if (id < 0 || id >= syncIP->maxChannels) {
+    xvfbsync_print ("Invalid channel %d\n", id);
+    return -1;
+  }
+
+  /* a reserved channel is handed over to its first channel object only, the
+   * reservation of a populated one belongs to somebody else */
+  if (atomic_fetch_or_explicit (&syncIP->populatedChannels, BIT(id), memory_order_acq_rel) & BIT(id)) {
+    xvfbsync_print ("Channel %d is already populated\n", id);
+    return -1;
+  }
+
+  syncChan->sync = syncIP;
+  syncChan->id = id;
+  syncChan->enabled = false;
+  syncChan->coreSplit.numCores = 1;
+  syncChan->coreSplit.ePartition = CORE_PARTITION_COLUMNS;
+  syncChan->coreSplit.iUnitSize = 64;
+  syncChan->recover = false;
+  memset (&syncChan->recoveryStats, 0, sizeof (syncChan->recoveryStats));
+  syncChan->recoveryAttempts = 0;
+  syncChan->restartAt = 0;
+  /* fails if the id comes from getFreeChannel, the reservation is taken
+   * over then. Otherwise makes sure getFreeChannel won't give this channel
+   * to someone else */
+  xvfbsync_syncIP_reserveChannel(syncIP, id);
+  syncChan->reserved = true;
+  xvfbsync_syncIP_addListener(syncIP, id, &xvfbsync_syncChan_listener);
+  xvfbsync_syncIP_openEventFd(syncIP, id);
+  return 0;
+}
+
+static void xvfbsync_syncChan_depopulate (struct SyncChannel1* syncChan)
+{
+  if(syncChan->enabled)
+    xvfbsync_syncChan_disable (syncChan);
+
+  xvfbsync_syncIP_removeListener(syncChan->sync, syncChan->id);
+  xvfbsync_syncIP_setEventHandler(syncChan->sync, syncChan->id, NULL, NULL);
+  xvfbsync_syncIP_closeEventFd(syncChan->sync, syncChan->id);
+
+  if (syncChan->reserved) {
+    syncChan->reserved = false;
+    xvfbsync_syncIP_releaseChannel(syncChan->sync, syncChan->id);
+    atomic_fetch_and_explicit (&syncChan->sync->populatedChannels, ~BIT(syncChan->id), memory_order_acq_rel);
+  }
+}
+
+static int xvfbsync_syncChan_setCoreSplit (struct SyncChannel1* syncChan, const struct CoreSplit1* split)
+{
+  if (split->numCores < 1 || split->numCores > syncChan->sync->maxCores || split->iUnitSize <= 0 ||
+    (split->ePartition != CORE_PARTITION_COLUMNS && split->ePartition != CORE_PARTITION_ROWS)) {
+    xvfbsync_print ("Invalid core split for channel %d\n", syncChan->id);
+    return -1;
+  }
+
+  syncChan->coreSplit = *split;
+  return 0;
+}
+
+static int xvfbsync_syncChan_setRecovery (struct SyncChannel1* syncChan, const struct RecoveryPolicy1* policy)
+{
+  if (policy && (policy->maxRetries < 1 || policy->backoffNs > policy->maxBackoffNs)) {
+    xvfbsync_print ("Invalid recovery policy for channel %d\n", syncChan->id);
+    return -1;
+  }
+
+  syncChan->recover = policy != NULL;
+
+  if (policy)
+    syncChan->recoveryPolicy = *policy;
+
+  syncChan->recoveryAttempts = 0;
+  syncChan->restartAt = 0;
+  return 0;
+}
+
+/* Clear the error, disable the channel (which releases its framebuffers),
+ * let prime program its slots again and enable it back (called locked) */
+static void xvfbsync_syncChan_restart (struct SyncChannel1* syncChan, void (*prime) (void*), void* opaque)
+{
+  struct ChannelState1* state = &syncChan->sync->channels[syncChan->id];
+  uint64_t start = xvfbsync_now ();
+
+  xvfbsync_syncIP_resetStatus (syncChan->sync, syncChan->id);
+  xvfbsync_syncIP_disableChannel (syncChan->sync, syncChan->id);
+  prime (opaque);
+  xvfbsync_syncIP_enableChannel (syncChan->sync, syncChan->id);
+
+  struct StatsCounters1* counters = xvfbsync_stats_counters (syncChan->sync, syncChan->id);
 
-  return buf->tPlanes[PLANE_UV].iPitch * iHeightC * 2;
+  if (counters)
+    xvfbsync_stats_add (&counters->recoveries, 1);
+
+  ++syncChan->recoveryAttempts;
+  ++syncChan->recoveryStats.recoveries;
+  syncChan->recoveryStats.lastRecoveryNs = xvfbsync_now () - start;
+  xvfbsync_print ("Restarted channel %d after an error\n", syncChan->id);
+  xvfbsync_syncIP_notify (state, XVFBSYNC_EVENT_RECOVERED);
+}
+
+/* Restart the channel if events report a sync or watchdog error.
+ * Consecutive restarts wait for a growing backoff, a completed frame resets
+ * it. The event thread doesn't restart the channel while it dispatches the
+ * events: the error is cleared right away and the restart, even the first
+ * one, is deferred until the channel gets XVFBSYNC_EVENT_RETRY once
+ * restartAt is reached. The errors reported meanwhile are only counted.
+ * Returns false if the channel gave up and stays disabled (called locked,
+ * from the event handler) */
+static bool xvfbsync_syncChan_recover (struct SyncChannel1* syncChan, uint32_t events, void (*prime) (void*), void* opaque)
+{
+  struct ChannelState1* state = &syncChan->sync->channels[syncChan->id];
+
+  if (events & XVFBSYNC_EVENT_PROGRESS)
+    syncChan->recoveryAttempts = 0;
+
+  /* the retry may have been asked for something else */
+  if ((events & XVFBSYNC_EVENT_RETRY) && syncChan->restartAt) {
+    uint64_t restartAt = syncChan->restartAt;
+
+    if (xvfbsync_now () < restartAt) {
+      xvfbsync_syncIP_armRetry (syncChan->sync, syncChan->id, restartAt);
+      return true;
+    }
+
+    syncChan->restartAt = 0;
+
+    if (syncChan->recover && syncChan->enabled)
+      xvfbsync_syncChan_restart (syncChan, prime, opaque);
+    return true;
+  }
+
+  if (!(events & (XVFBSYNC_EVENT_SYNC_ERROR | XVFBSYNC_EVENT_WATCHDOG_ERROR)))
+    return true;
+
+  ++syncChan->recoveryStats.errors;
+
+  if (!syncChan->recover || !syncChan->enabled)
+    return true;
+
+  if (syncChan->restartAt) {
+    xvfbsync_syncIP_resetStatus (syncChan->sync, syncChan->id);
+    state->errorsHandled = true;
+    return true;
+  }
+
+  if (syncChan->recoveryAttempts >= syncChan->recoveryPolicy.maxRetries) {
+    xvfbsync_print ("Channel %d didn't recover after %d restarts\n", syncChan->id, syncChan->recoveryAttempts);
+    ++syncChan->recoveryStats.failures;
+    xvfbsync_syncChan_disable (syncChan);
+    xvfbsync_syncIP_notify (state, XVFBSYNC_EVENT_RECOVERY_FAILED);
+    return false;
+  }
+
+  uint64_t backoff = 0;
+
+  if (syncChan->recoveryAttempts > 0)
+  {
+    int shift = MIN(syncChan->recoveryAttempts - 1, 63);
+    backoff = syncChan->recoveryPolicy.backoffNs;
+    backoff = backoff > (syncChan->recoveryPolicy.maxBackoffNs >> shift) ? syncChan->recoveryPolicy.maxBackoffNs : backoff << shift;
+  }
+
+  /* the device stops reporting the error until the restart */
+  xvfbsync_syncIP_resetStatus (syncChan->sync, syncChan->id);
+  state->errorsHandled = true;
+  syncChan->restartAt = xvfbsync_now () + backoff;
+  xvfbsync_syncIP_armRetry (syncChan->sync, syncChan->id, syncChan->restartAt);
+  return true;
+}
+
+static int xvfbsync_syncChan_getEventFd (struct SyncChannel1* syncChan)
+{
+  return syncChan->sync->channels[syncChan->id].notifyFd;
+}
+
+static uint32_t xvfbsync_syncChan_drainEvents (struct SyncChannel1* syncChan)
+{
+  if (xvfbsync_syncChan_getEventFd (syncChan) == -1)
+    return 0;
+
+  return xvfbsync_syncIP_drainEvents (syncChan->sync, syncChan->id);
+}
+
+/* ******************** */
+/* xvfbsync decSyncChan */
+/* ******************** */
+
+/* The config is computed when the buffer is queued, so the caller can
+ * reuse its LLP2Buf right away (called locked) */
+static int xvfbsync_decSyncChan_queueBuffer(struct DecSyncChannel1* decSyncChan, LLP2Buf* buf, const TFormatDesc* desc)
+{
+  struct QueueEntry* entry = xvfbsync_queue_push (&decSyncChan->buffers, buf, desc);
+
+  if (!entry) {
+    xvfbsync_print ("Couldn't queue buffer\n");
+    return -1;
+  }
+
+  entry->config = setDecFrameBufferConfig(decSyncChan->syncChannel.id, buf, desc, &decSyncChan->syncChannel.coreSplit, decSyncChan->lcuSize);
+  //printFrameBufferConfig(&entry->config, decSyncChan->syncChannel->sync->maxUsers, decSyncChan->syncChannel->sync->maxCores);
+  entry->configValid = true;
+  return 0;
+}
+
+/* Closed loop margin tuning: a margin grows by step as soon as an error is
+ * reported on its plane and shrinks by step after requiredQuiet frames
+ * without error. Each error doubles the quiet period needed before the next
+ * decrease (up to XVFBSYNC_MARGIN_MAX_BACKOFF times quietFrames), it is only
+ * halved back once a lowered margin stayed error free for a whole period.
+ * So the margin settles right above the smallest error free value and only
+ * probes the failing value less and less often */
+static uint32_t xvfbsync_margin_clamp(uint32_t margin, const struct MarginControl1* control)
+{
+  if (margin < control->minMargin)
+    return control->minMargin;
+
+  return margin > control->maxMargin ? control->maxMargin : margin;
+}
+
+static void xvfbsync_margin_update(struct MarginState1* state, const struct MarginControl1* control, bool error, int numFrames)
+{
+  /* within [minMargin, maxMargin] the differences below can't wrap */
+  state->margin = xvfbsync_margin_clamp (state->margin, control);
+
+  if (error) {
+    state->margin = control->maxMargin - state->margin > control->step ? state->margin + control->step : control->maxMargin;
+    state->quiet = 0;
+    state->requiredQuiet = MIN(state->requiredQuiet * 2, control->quietFrames * XVFBSYNC_MARGIN_MAX_BACKOFF);
+    state->lowered = false;
+    return;
+  }
+
+  state->quiet += numFrames;
+
+  if (state->quiet < state->requiredQuiet)
+    return;
+
+  if (state->lowered)
+    state->requiredQuiet = state->requiredQuiet / 2 > control->quietFrames ? state->requiredQuiet / 2 : control->quietFrames;
+
+  state->quiet = 0;
+  state->lowered = state->margin > control->minMargin;
+  state->margin = state->margin - control->minMargin > control->step ? state->margin - control->step : control->minMargin;
+}
+
+/* called locked */
+static void xvfbsync_decSyncChan_adaptMargins(struct DecSyncChannel1* decSyncChan, uint32_t events)
+{
+  if (!decSyncChan->adaptiveMargins)
+    return;
+
+  int numFrames = __builtin_popcount (events & XVFBSYNC_EVENT_FB_DONE_MASK);
+  bool syncError = events & XVFBSYNC_EVENT_SYNC_ERROR;
+
+  xvfbsync_margin_update (&decSyncChan->lumaMargin, &decSyncChan->marginControl, syncError || (events & XVFBSYNC_EVENT_LUMA_DIFF_ERROR), numFrames);
+  xvfbsync_margin_update (&decSyncChan->chromaMargin, &decSyncChan->marginControl, syncError || (events & XVFBSYNC_EVENT_CHROMA_DIFF_ERROR), numFrames);
+}
+
+/* Program the queued buffers in order while the hardware has free slots
+ * (called locked).
+ * The slots are tracked from the framebuffer completions, if the driver
+ * can't report them we let it search a free slot until it refuses. A
+ * buffer the driver refuses for another reason is dropped */
+static void xvfbsync_decSyncChan_drain(struct DecSyncChannel1* decSyncChan)
+{
+  struct SyncIp1* syncIP = decSyncChan->syncChannel.sync;
+
+  while (decSyncChan->isRunning && !xvfbsync_queue_empty (&decSyncChan->buffers))
+  {
+    struct QueueEntry* entry = xvfbsync_queue_front (&decSyncChan->buffers);
+    struct xvsfsync_chan_config config = entry->config;
+    int fbId = XVSFSYNC_AUTO_SEARCH;
+
+    config.luma_margin = decSyncChan->lumaMargin.margin;
+    config.chroma_margin = decSyncChan->chromaMargin.margin;
+
+    if (syncIP->trackFbDone)
+    {
+      for (fbId = 0; fbId < syncIP->maxBuffers && (decSyncChan->busySlots & BIT(fbId)); ++fbId)
+        ;
+
+      if (fbId == syncIP->maxBuffers)
+        return;
+
+      config.fb_id[XVSFSYNC_PROD] = fbId;
+      config.fb_id[XVSFSYNC_CONS] = fbId;
+    }
+
+    if (xvfbsync_syncIP_addBuffer(syncIP, &config)) {
+      /* the buffer stays queued. It is retried when a slot is released, or
+       * after a while when the slot releases can't be seen or were missed */
+      if (errno == EBUSY) {
+        xvfbsync_syncIP_armRetry (syncIP, decSyncChan->syncChannel.id, xvfbsync_now () + XVFBSYNC_DEC_RETRY_NS);
+        return;
+      }
+
+      struct StatsCounters1* counters = xvfbsync_stats_counters (syncIP, decSyncChan->syncChannel.id);
+
+      if (counters)
+        xvfbsync_stats_add (&counters->buffersRejected, 1);
+
+      /* notifyFd doesn't change while the channel is populated, the event
+       * thread lock isn't needed (and would invert the lock order) */
+      xvfbsync_syncIP_notify (&syncIP->channels[decSyncChan->syncChannel.id], XVFBSYNC_EVENT_BUFFER_REJECTED);
+      xvfbsync_queue_pop (&decSyncChan->buffers);
+      continue;
+    }
+
+    if (fbId != XVSFSYNC_AUTO_SEARCH) {
+      decSyncChan->busySlots |= BIT(fbId);
+      decSyncChan->slots[fbId] = config;
+    }
+
+    xvfbsync_queue_pop (&decSyncChan->buffers);
+    xvfbsync_print ("Pushed buffer in sync ip\n");
+    //printChannelStatus(sync->getStatus(id));
+  }
+}
+
+/* Program again the buffers that were in the hardware slots when the
+ * channel was restarted, then the queued ones (called locked).
+ * Without framebuffer tracking the slots aren't known, only the queued
+ * buffers are programmed */
+static void xvfbsync_decSyncChan_prime(void* opaque)
+{
+  struct DecSyncChannel1* decSyncChan = opaque;
+  struct SyncIp1* syncIP = decSyncChan->syncChannel.sync;
+
+  for (int fbId = 0; fbId < syncIP->maxBuffers; ++fbId)
+  {
+    if ((decSyncChan->busySlots & BIT(fbId)) && xvfbsync_syncIP_addBuffer(syncIP, &decSyncChan->slots[fbId]))
+      decSyncChan->busySlots &= ~BIT(fbId);
+  }
+
+  xvfbsync_decSyncChan_drain (decSyncChan);
+}
+
+static void xvfbsync_decSyncChan_onEvents(void* opaque, uint32_t events)
+{
+  struct DecSyncChannel1* decSyncChan = opaque;
+
+  pthread_mutex_lock (&decSyncChan->mutex);
+
+  /* a restart isn't a frame */
+  if (!(events & XVFBSYNC_EVENT_RETRY))
+    xvfbsync_decSyncChan_adaptMargins (decSyncChan, events);
+
+  decSyncChan->busySlots &= ~(events & XVFBSYNC_EVENT_FB_DONE_MASK);
+
+  if (!xvfbsync_syncChan_recover (&decSyncChan->syncChannel, events, &xvfbsync_decSyncChan_prime, decSyncChan))
+    decSyncChan->isRunning = false;
+
+  xvfbsync_decSyncChan_drain (decSyncChan);
+  pthread_mutex_unlock (&decSyncChan->mutex);
+}
+
+void xvfbsync_decSyncChan_addBuffer(struct DecSyncChannel1* decSyncChan, LLP2Buf* buf)
+{
+  const TFormatDesc* desc = xvfbsync_format_lookup (buf->tFourCC);
+
+  if (!desc) {
+    xvfbsync_print ("Unsupported fourcc %08x\n", buf->tFourCC);
+    return;
+  }
+
+  pthread_mutex_lock (&decSyncChan->mutex);
+
+  if (!xvfbsync_decSyncChan_queueBuffer (decSyncChan, buf, desc))
+    xvfbsync_decSyncChan_drain (decSyncChan);
+
+  pthread_mutex_unlock (&decSyncChan->mutex);
+}
+
+int xvfbsync_decSyncChan_addBuffers(struct DecSyncChannel1* decSyncChan, LLP2Buf** bufs, int numBufs)
+{
+  /* nothing is queued if one of the buffers is invalid */
+  for (int i = 0; i < numBufs; ++i)
+  {
+    if (!bufs[i] || !xvfbsync_format_lookup (bufs[i]->tFourCC)) {
+      xvfbsync_print ("Invalid buffer %d in batch\n", i);
+      return -1;
+    }
+  }
+
+  int ret = 0;
+
+  pthread_mutex_lock (&decSyncChan->mutex);
+
+  if (xvfbsync_queue_reserve (&decSyncChan->buffers, numBufs)) {
+    pthread_mutex_unlock (&decSyncChan->mutex);
+    xvfbsync_print ("Couldn't queue %d buffers\n", numBufs);
+    return -1;
+  }
+
+  for (int i = 0; i < numBufs && !ret; ++i)
+    ret = xvfbsync_decSyncChan_queueBuffer (decSyncChan, bufs[i], xvfbsync_format_lookup (bufs[i]->tFourCC));
+
+  xvfbsync_decSyncChan_drain (decSyncChan);
+  pthread_mutex_unlock (&decSyncChan->mutex);
+  return ret;
+}
+
+int xvfbsync_decSyncChan_getNumPending(struct DecSyncChannel1* decSyncChan)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+  int numPending = decSyncChan->buffers.size;
+  pthread_mutex_unlock (&decSyncChan->mutex);
+  return numPending;
+}
+
+void xvfbsync_decSyncChan_enable(struct DecSyncChannel1* decSyncChan)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+  decSyncChan->isRunning = true;
+  /* the slots a previous run left programmed were freed by its disable */
+  decSyncChan->busySlots = 0;
+  xvfbsync_latency_forget (decSyncChan->syncChannel.sync, decSyncChan->syncChannel.id);
+  xvfbsync_decSyncChan_drain (decSyncChan);
+  xvfbsync_syncIP_enableChannel (decSyncChan->syncChannel.sync, decSyncChan->syncChannel.id);
+  decSyncChan->syncChannel.enabled = true;
+  pthread_mutex_unlock (&decSyncChan->mutex);
+}
+
+void xvfbsync_decSyncChan_setMargins(struct DecSyncChannel1* decSyncChan, uint32_t lumaMargin, uint32_t chromaMargin)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+
+  if (decSyncChan->adaptiveMargins) {
+    lumaMargin = xvfbsync_margin_clamp (lumaMargin, &decSyncChan->marginControl);
+    chromaMargin = xvfbsync_margin_clamp (chromaMargin, &decSyncChan->marginControl);
+  }
+
+  decSyncChan->lumaMargin.margin = lumaMargin;
+  decSyncChan->chromaMargin.margin = chromaMargin;
+  pthread_mutex_unlock (&decSyncChan->mutex);
+}
+
+void xvfbsync_decSyncChan_getMargins(struct DecSyncChannel1* decSyncChan, uint32_t* lumaMargin, uint32_t* chromaMargin)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+  *lumaMargin = decSyncChan->lumaMargin.margin;
+  *chromaMargin = decSyncChan->chromaMargin.margin;
+  pthread_mutex_unlock (&decSyncChan->mutex);
+}
+
+int xvfbsync_decSyncChan_setAdaptiveMargins(struct DecSyncChannel1* decSyncChan, const struct MarginControl1* control)
+{
+  if (control && (control->minMargin > control->maxMargin || !control->step || control->quietFrames <= 0)) {
+    xvfbsync_print ("Invalid margin control for channel %d\n", decSyncChan->syncChannel.id);
+    return -1;
+  }
+
+  pthread_mutex_lock (&decSyncChan->mutex);
+  decSyncChan->adaptiveMargins = control != NULL;
+
+  if (control)
+  {
+    struct MarginState1* states[] = { &decSyncChan->lumaMargin, &decSyncChan->chromaMargin };
+
+    decSyncChan->marginControl = *control;
+
+    /* start from the current margins */
+    for (int i = 0; i < 2; ++i)
+    {
+      states[i]->margin = xvfbsync_margin_clamp (states[i]->margin, control);
+      states[i]->quiet = 0;
+      states[i]->requiredQuiet = control->quietFrames;
+      states[i]->lowered = false;
+    }
+  }
+
+  pthread_mutex_unlock (&decSyncChan->mutex);
+  return 0;
+}
+
+int xvfbsync_decSyncChan_setCoreSplit(struct DecSyncChannel1* decSyncChan, const struct CoreSplit1* split)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+  int ret = xvfbsync_syncChan_setCoreSplit (&decSyncChan->syncChannel, split);
+  pthread_mutex_unlock (&decSyncChan->mutex);
+  return ret;
+}
+
+int xvfbsync_decSyncChan_setLcuSize(struct DecSyncChannel1* decSyncChan, int lcuSize)
+{
+  if (lcuSize != 0 && lcuSize != 16 && lcuSize != 32 && lcuSize != 64) {
+    xvfbsync_print ("Invalid lcu size %d", lcuSize);
+    return -1;
+  }
+
+  pthread_mutex_lock (&decSyncChan->mutex);
+  decSyncChan->lcuSize = lcuSize;
+  pthread_mutex_unlock (&decSyncChan->mutex);
+  return 0;
+}
+
+int xvfbsync_decSyncChan_setRecovery(struct DecSyncChannel1* decSyncChan, const struct RecoveryPolicy1* policy)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+  int ret = xvfbsync_syncChan_setRecovery (&decSyncChan->syncChannel, policy);
+  pthread_mutex_unlock (&decSyncChan->mutex);
+  return ret;
+}
+
+void xvfbsync_decSyncChan_getRecoveryStats(struct DecSyncChannel1* decSyncChan, struct RecoveryStats1* stats)
+{
+  pthread_mutex_lock (&decSyncChan->mutex);
+  *stats = decSyncChan->syncChannel.recoveryStats;
+  pthread_mutex_unlock (&decSyncChan->mutex);
+}
+
+int xvfbsync_decSyncChan_getEventFd(struct DecSyncChannel1* decSyncChan)
+{
+  return xvfbsync_syncChan_getEventFd (&decSyncChan->syncChannel);
+}
+
+uint32_t xvfbsync_decSyncChan_drainEvents(struct DecSyncChannel1* decSyncChan)
+{
+  return xvfbsync_syncChan_drainEvents (&decSyncChan->syncChannel);
+}
+
+int xvfbsync_decSyncChan_populate(struct DecSyncChannel1* decSyncChan, struct SyncIp1* syncIP, int id)
+{
+  if (xvfbsync_syncChan_populate (&(decSyncChan->syncChannel), syncIP, id))
+    return -1;
+
+  decSyncChan->isRunning = false;
+  decSyncChan->busySlots = 0;
+  decSyncChan->adaptiveMargins = false;
+  decSyncChan->lcuSize = 0;
+  memset (&decSyncChan->lumaMargin, 0, sizeof (decSyncChan->lumaMargin));
+  memset (&decSyncChan->chromaMargin, 0, sizeof (decSyncChan->chromaMargin));
+  if (pthread_mutex_init (&(decSyncChan->mutex), NULL)) {
+    xvfbsync_print ("Couldn't intialize lock");
+    xvfbsync_syncChan_depopulate (&(decSyncChan->syncChannel));
+    return -1;
+  }
+  if (xvfbsync_queue_init (&(decSyncChan->buffers), XVFBSYNC_QUEUE_INITIAL_CAPACITY)) {
+    xvfbsync_print ("Couldn't allocate the buffer queue");
+    pthread_mutex_destroy (&(decSyncChan->mutex));
+    xvfbsync_syncChan_depopulate (&(decSyncChan->syncChannel));
+    return -1;
+  }
+  xvfbsync_syncIP_setEventHandler (syncIP, id, &xvfbsync_decSyncChan_onEvents, decSyncChan);
+  return 0;
 }
 
-static int xvsfsync_chan_getOffsetUV(LLP2Buf* buf)
-{
-  assert(buf->tPlanes[PLANE_Y].iPitch * buf->tDim.iHeight <= buf->tPlanes[PLANE_UV].iOffset ||
-         (IsTiled(buf->tFourCC) &&
-          (buf->tPlanes[PLANE_Y].iPitch * buf->tDim.iHeight / 4 <= buf->tPlanes[PLANE_UV].iOffset)));
-  return buf->tPlanes[PLANE_UV].iOffset;
+void xvfbsync_decSyncChan_depopulate(struct DecSyncChannel1* decSyncChan)
+{
+  xvfbsync_syncChan_depopulate (&(decSyncChan->syncChannel));
+
+  /* the decoder doesn't own its buffers, only their configs are queued */
+  xvfbsync_queue_deinit (&decSyncChan->buffers);
+  pthread_mutex_destroy (&(decSyncChan->mutex));
+}
+
+/* **************************** */
+/* xvfbsync encSyncChan helpers */
+/* **************************** */
+
+/* The encoder keeps rotating the same set of buffers, so the config of each
+ * buffer is computed once and handed as is to the driver for every frame */
+static void xvfbsync_encSyncChan_prepareConfig(struct EncSyncChannel1* encSyncChan, struct QueueEntry* entry)
+{
+  entry->config = setEncFrameBufferConfig(encSyncChan->syncChannel.id, entry->buf, entry->desc, encSyncChan->hardwareHorizontalStrideAlignment, encSyncChan->hardwareVerticalStrideAlignment, &encSyncChan->syncChannel.coreSplit);
+  entry->configValid = true;
+}
+
+static void xvfbsync_encSyncChan_prepareConfigs(struct EncSyncChannel1* encSyncChan)
+{
+  struct Queue* q = &encSyncChan->buffers;
+
+  for (unsigned int i = 0; i < q->size; ++i)
+  {
+    struct QueueEntry* entry = &q->entries[(q->head + i) & (q->capacity - 1)];
+
+    if (!entry->configValid)
+      xvfbsync_encSyncChan_prepareConfig (encSyncChan, entry);
+  }
+}
+
+static int xvfbsync_encSyncChan_queueBuffer(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf, const TFormatDesc* desc)
+{
+  struct QueueEntry* entry = xvfbsync_queue_push (&encSyncChan->buffers, buf, desc);
+
+  if (!entry) {
+    xvfbsync_print ("Couldn't queue buffer\n");
+    return -1;
+  }
+
+  xvfbsync_encSyncChan_prepareConfig (encSyncChan, entry);
+  return 0;
+}
+
+/* Least recently completed buffer that isn't in a hardware slot, buffers
+ * that were never programmed come first */
+static struct QueueEntry* xvfbsync_encSyncChan_pickBuffer(struct EncSyncChannel1* encSyncChan)
+{
+  struct Queue* q = &encSyncChan->buffers;
+  struct QueueEntry* best = NULL;
+
+  for (unsigned int i = 0; i < q->size; ++i)
+  {
+    struct QueueEntry* entry = &q->entries[(q->head + i) & (q->capacity - 1)];
+
+    if (entry->fbId == -1 && (!best || entry->completedAt < best->completedAt))
+      best = entry;
+  }
+
+  return best;
+}
+
+/* Program the free hardware slot fbId with the next buffer (auto recycle) */
+static int xvfbsync_encSyncChan_programSlot(struct EncSyncChannel1* encSyncChan, int fbId)
+{
+  struct QueueEntry* entry = xvfbsync_encSyncChan_pickBuffer (encSyncChan);
+
+  /* all the buffers are already in the hardware */
+  if (!entry)
+    return 0;
+
+  if (!entry->configValid)
+    xvfbsync_encSyncChan_prepareConfig (encSyncChan, entry);
+
+  struct xvsfsync_chan_config config = entry->config;
+  config.fb_id[XVSFSYNC_PROD] = fbId;
+  config.fb_id[XVSFSYNC_CONS] = fbId;
+
+  if (xvfbsync_syncIP_addBuffer(encSyncChan->syncChannel.sync, &config))
+    return -1;
+
+  entry->fbId = fbId;
+  return 0;
+}
+
+/* The buffer in slot fbId completed, refill the slot (called locked) */
+static void xvfbsync_encSyncChan_recycle(struct EncSyncChannel1* encSyncChan, int fbId, uint64_t now)
+{
+  struct Queue* q = &encSyncChan->buffers;
+
+  for (unsigned int i = 0; i < q->size; ++i)
+  {
+    struct QueueEntry* entry = &q->entries[(q->head + i) & (q->capacity - 1)];
+
+    if (entry->fbId == fbId) {
+      entry->fbId = -1;
+      entry->completedAt = now;
+    }
+  }
+
+  xvfbsync_encSyncChan_programSlot (encSyncChan, fbId);
+}
+
+static void xvfbsync_encSyncChan_prime(void* opaque);
+
+static void xvfbsync_encSyncChan_onEvents(void* opaque, uint32_t events)
+{
+  struct EncSyncChannel1* encSyncChan = opaque;
+  uint64_t now = xvfbsync_now ();
+
+  pthread_mutex_lock (&encSyncChan->mutex);
+
+  if (!xvfbsync_syncChan_recover (&encSyncChan->syncChannel, events, &xvfbsync_encSyncChan_prime, encSyncChan))
+    encSyncChan->isRunning = false;
+
+  for (int fbId = 0; fbId < MAX_FB_NUMBER && encSyncChan->isRunning && encSyncChan->autoRecycle; ++fbId)
+  {
+    if (events & XVFBSYNC_EVENT_FB_DONE(fbId))
+      xvfbsync_encSyncChan_recycle (encSyncChan, fbId, now);
+  }
+
+  pthread_mutex_unlock (&encSyncChan->mutex);
 }
 
-static struct xvsfsync_chan_config setEncFrameBufferConfig(int channelId, LLP2Buf* buf, int hardwareHorizontalStrideAlignment, int hardwareVerticalStrideAlignment)
+static void xvfbsync_encSyncChan_primeSlots(struct EncSyncChannel1* encSyncChan)
 {
-  uint32_t physical = buf->phyAddr;
-
-  struct xvsfsync_chan_config config;
-
-  config.luma_start_address[XVSFSYNC_PROD] = physical + buf->tPlanes[PLANE_Y].iOffset;
-  config.luma_end_address[XVSFSYNC_PROD] = config.luma_start_address[XVSFSYNC_PROD] + xvsfsync_chan_getLumaSize (buf) - buf->tPlanes[PLANE_Y].iPitch + buf->tDim.iWidth - 1;
+  struct Queue* q = &encSyncChan->buffers;
 
-  config.luma_start_address[XVSFSYNC_CONS] = physical + buf->tPlanes[PLANE_Y].iOffset;
-  /*           <------------> stride
-   *           <--------> width
-   * height   ^
-   *          |
-   *          |
-   *          v         x last pixel of the image
-   * end = (height - 1) * stride + width - 1 (to get the last pixel of the image)
-   * total_size = height * stride
-   * end = total_size - stride + width - 1
-   */
-  int iHardwarePitch = RoundUp(buf->tPlanes[PLANE_Y].iPitch, hardwareHorizontalStrideAlignment);
-  int iHardwareLumaVerticalPitch = RoundUp(buf->tDim.iHeight, hardwareVerticalStrideAlignment);
-  config.luma_end_address[XVSFSYNC_CONS] = config.luma_start_address[XVSFSYNC_CONS] + (iHardwarePitch * (iHardwareLumaVerticalPitch - 1)) + RoundUp(buf->tDim.iWidth, hardwareHorizontalStrideAlignment) - 1;
+  for (unsigned int i = 0; i < q->size; ++i)
+    q->entries[(q->head + i) & (q->capacity - 1)].fbId = -1;
 
-  /* chroma is the same, but the width depends on the format of the yuv
-   * here we make the assumption that the fourcc is semi planar */
-  if(!IsMonochrome(buf->tFourCC))
+  for (int fbId = 0; fbId < encSyncChan->syncChannel.sync->maxBuffers; ++fbId)
   {
-    assert(IsSemiPlanar(buf->tFourCC));
-    config.chroma_start_address[XVSFSYNC_PROD] = physical + xvsfsync_chan_getOffsetUV (buf);
-    config.chroma_end_address[XVSFSYNC_PROD] = config.chroma_start_address[XVSFSYNC_PROD] + xvsfsync_chan_getChromaSize (buf) - buf->tPlanes[PLANE_UV].iPitch + buf->tDim.iWidth - 1;
-    config.chroma_start_address[XVSFSYNC_CONS] = physical + xvsfsync_chan_getOffsetUV (buf);
-    int iVerticalFactor = (GetChromaMode(buf->tFourCC) == CHROMA_4_2_0) ? 2 : 1;
-    int iHardwareChromaVerticalPitch = RoundUp((buf->tDim.iHeight / iVerticalFactor), (hardwareVerticalStrideAlignment / iVerticalFactor));
-    config.chroma_end_address[XVSFSYNC_CONS] = config.chroma_start_address[XVSFSYNC_CONS] + (iHardwarePitch * (iHardwareChromaVerticalPitch - 1)) + RoundUp(buf->tDim.iWidth, hardwareHorizontalStrideAlignment) - 1;
+    if (xvfbsync_encSyncChan_programSlot (encSyncChan, fbId) == 0)
+      xvfbsync_print ("Pushed buffer in sync ip\n");
   }
-  else
+}
+
+static int xvfbsync_encSyncChan_addBuffer_(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf, int numFbToEnable)
+{
+  int ret = 0;
+
+  if (buf)
   {
-    for(int user = 0; user < XVSFSYNC_IO; user++)
-    {
-      config.chroma_start_address[user] = 0;
-      config.chroma_end_address[user] = 0;
-      config.ismono[user] = 1;
+    /* we do not support adding buffer when the pipeline is running */
+    assert (!encSyncChan->isRunning);
+    const TFormatDesc* desc = xvfbsync_format_lookup (buf->tFourCC);
+
+    if (!desc) {
+      xvfbsync_print ("Unsupported fourcc %08x\n", buf->tFourCC);
+      return -1;
     }
+
+    if (xvfbsync_encSyncChan_queueBuffer (encSyncChan, buf, desc))
+      return -1;
   }
 
-  for(int core = 0; core < XVSFSYNC_MAX_CORES; core++)
+  /* If we don't want to start the ip yet, we do not program
+   * the ip registers, we just keep the buffer in our queue
+   *
+   * When we start the channel, we try to add as much buffer
+   * as we can inside the hw ip.
+   *
+   * Once we are running, we keep the same set of buffer and when
+   * one of the buffer is finished we replace it with a new one from the queue
+   * in a round robin fashion.
+   *
+   * In auto recycle mode the slots are refilled by the event thread
+   * instead, as soon as they are released */
+
+  while(encSyncChan->isRunning && !encSyncChan->autoRecycle && numFbToEnable > 0 && !xvfbsync_queue_empty (&encSyncChan->buffers))
   {
-    config.luma_core_offset[core] = 0;
-    config.chroma_core_offset[core] = 0;
-  }
+    struct QueueEntry* entry = xvfbsync_queue_front (&encSyncChan->buffers);
 
-  /* no margin for now (only needed for the decoder) */
-  config.luma_margin = 0;
-  config.chroma_margin = 0;
+    if (!entry->configValid)
+      xvfbsync_encSyncChan_prepareConfig (encSyncChan, entry);
+    //printFrameBufferConfig(&entry->config, sync->maxUsers, sync->maxCores);
 
-  config.fb_id[XVSFSYNC_PROD] = XVSFSYNC_AUTO_SEARCH;
-  config.fb_id[XVSFSYNC_CONS] = XVSFSYNC_AUTO_SEARCH;
-  config.channel_id = channelId;
+    if (xvfbsync_syncIP_addBuffer(encSyncChan->syncChannel.sync, &entry->config))
+      ret = -1;
+    else
+      xvfbsync_print ("Pushed buffer in sync ip\n");
+    //printChannelStatus(sync->getStatus(id));
+    xvfbsync_queue_rotate (&encSyncChan->buffers);
+    --numFbToEnable;
+  }
 
-  return config;
+  return ret;
 }
 
-static struct xvsfsync_chan_config setDecFrameBufferConfig(int channelId, LLP2Buf* buf)
+/* Fill the hardware slots from the buffers of the channel (called locked) */
+static void xvfbsync_encSyncChan_prime(void* opaque)
 {
-  uint32_t physical = buf->phyAddr;
+  struct EncSyncChannel1* encSyncChan = opaque;
 
-  struct xvsfsync_chan_config config;
+  if (encSyncChan->autoRecycle)
+  {
+    xvfbsync_encSyncChan_primeSlots (encSyncChan);
+    return;
+  }
 
-  config.luma_start_address[XVSFSYNC_PROD] = physical + buf->tPlanes[PLANE_Y].iOffset;
+  int numFbToEnable = MIN((int)encSyncChan->buffers.size, encSyncChan->syncChannel.sync->maxBuffers);
+  xvfbsync_encSyncChan_addBuffer_ (encSyncChan, NULL, numFbToEnable);
+}
 
-  /*           <------------> stride
-   *           <--------> width
-   * height   ^
-   *          |
-   *          |
-   *          v         x last pixel of the image
-   * end = (height - 1) * stride + width - 1 (to get the last pixel of the image)
-   * total_size = height * stride
-   * end = total_size - stride + width - 1
-   */
-  // TODO : This should be LCU and 64 aligned
-  config.luma_end_address[XVSFSYNC_PROD] = config.luma_start_address[XVSFSYNC_PROD] + xvsfsync_chan_getLumaSize (buf) - buf->tPlanes[PLANE_Y].iPitch + buf->tDim.iWidth - 1;
-  config.luma_start_address[XVSFSYNC_CONS] = physical + buf->tPlanes[PLANE_Y].iOffset;
-  config.luma_end_address[XVSFSYNC_CONS] = config.luma_start_address[XVSFSYNC_CONS] + xvsfsync_chan_getLumaSize (buf) - buf->tPlanes[PLANE_Y].iPitch + buf->tDim.iWidth - 1;
+/* Wait for a request: poll the ring for spinNs, then sleep on wakeFd. The
+ * submitting thread only writes wakeFd when sleeping is set, so it doesn't
+ * pay a syscall while the submitter is busy or spinning.
+ * Returns false once the ring is empty and quit is set */
+static bool xvfbsync_async_wait(struct AsyncSubmitter1* async)
+{
+  uint64_t head = atomic_load_explicit (&async->head, memory_order_relaxed);
+  uint64_t deadline = xvfbsync_now () + async->config.spinNs;
 
-  /* chroma is the same, but the width depends on the format of the yuv
-   * here we make the assumption that the fourcc is semi planar */
-  if(!IsMonochrome(buf->tFourCC))
-  {
-    assert(IsSemiPlanar(buf->tFourCC));
-    config.chroma_start_address[XVSFSYNC_PROD] = physical + xvsfsync_chan_getOffsetUV (buf);
-    // TODO : This should be LCU and 64 aligned
-    config.chroma_end_address[XVSFSYNC_PROD] = config.chroma_start_address[XVSFSYNC_PROD] + xvsfsync_chan_getChromaSize (buf) - buf->tPlanes[PLANE_UV].iPitch + buf->tDim.iWidth - 1;
-    config.chroma_start_address[XVSFSYNC_CONS] = physical + xvsfsync_chan_getOffsetUV (buf);
-    config.chroma_end_address[XVSFSYNC_CONS] = config.chroma_start_address[XVSFSYNC_CONS] + xvsfsync_chan_getChromaSize (buf) - buf->tPlanes[PLANE_UV].iPitch + buf->tDim.iWidth - 1;
-  }
-  else
+  while (atomic_load_explicit (&async->tail, memory_order_acquire) == head)
   {
-    for(int user = 0; user < XVSFSYNC_IO; user++)
+    if (atomic_load_explicit (&async->quit, memory_order_acquire))
+      return false;
+
+    /* let the submitting thread run if it shares our core */
+    if (xvfbsync_now () < deadline) {
+      sched_yield ();
+      continue;
+    }
+
+    atomic_store_explicit (&async->sleeping, true, memory_order_seq_cst);
+
+    /* a request pushed before sleeping was set didn't wake us up */
+    if (atomic_load_explicit (&async->tail, memory_order_seq_cst) == head && !atomic_load_explicit (&async->quit, memory_order_acquire))
     {
-      config.chroma_start_address[user] = 0;
-      config.chroma_end_address[user] = 0;
-      config.ismono[user] = 1;
+      uint64_t value;
+
+      if (read (async->wakeFd, &value, sizeof (value)) != sizeof (value) && errno != EINTR) {
+        xvfbsync_print ("Couldn't wait for submissions (errno: %d)\n", errno);
+        return false;
+      }
     }
+
+    atomic_store_explicit (&async->sleeping, false, memory_order_relaxed);
+    deadline = xvfbsync_now () + async->config.spinNs;
   }
 
-  for(int core = 0; core < XVSFSYNC_MAX_CORES; core++)
+  return true;
+}
+
+static void* xvfbsync_async_routine(void* arg)
+{
+  struct AsyncSubmitter1* async = arg;
+  struct EncSyncChannel1* encSyncChan = async->encSyncChan;
+
+  while (xvfbsync_async_wait (async))
   {
-    config.luma_core_offset[core] = 0;
-    config.chroma_core_offset[core] = 0;
-  }
+    uint64_t head = atomic_load_explicit (&async->head, memory_order_relaxed);
+    LLP2Buf* buf = async->ring[head & (async->config.capacity - 1)];
+    int ret;
 
-  /* no margin for now (only needed for the decoder) */
-  config.luma_margin = 0;
-  config.chroma_margin = 0;
+    pthread_mutex_lock (&encSyncChan->mutex);
 
-  config.fb_id[XVSFSYNC_PROD] = XVSFSYNC_AUTO_SEARCH;
-  config.fb_id[XVSFSYNC_CONS] = XVSFSYNC_AUTO_SEARCH;
-  config.channel_id = channelId;
+    if (buf && encSyncChan->isRunning) {
+      /* we do not support adding buffer when the pipeline is running */
+      xvfbsync_print ("Couldn't add buffer to running channel %d\n", encSyncChan->syncChannel.id);
+      ret = -1;
+    } else
+      ret = xvfbsync_encSyncChan_addBuffer_ (encSyncChan, buf, 1);
 
-  return config;
+    /* the slot can be reused as soon as head moved */
+    atomic_store_explicit (&async->head, head + 1, memory_order_release);
+    atomic_store_explicit (&async->completed, head + 1, memory_order_release);
+
+    /* no-op without waiters, enable waits for the ring to drain */
+    pthread_cond_broadcast (&encSyncChan->submitted);
+    pthread_mutex_unlock (&encSyncChan->mutex);
+
+    if (async->config.callback)
+      async->config.callback (async->config.opaque, head + 1, ret);
+  }
+
+  return NULL;
 }
 
-static void xvfbsync_syncChan_listener (struct ChannelStatus1* status)
+static struct AsyncSubmitter1* xvfbsync_async_start(struct EncSyncChannel1* encSyncChan, const struct AsyncSubmit1* config)
 {
-  printf ("watchdog: %d, sync: %d, ldiff: %d, cdiff: %d\n", status->watchdogError, status->syncError, status->lumaDiffError, status->chromaDiffError);
+  struct AsyncSubmitter1* async;
+
+  if (posix_memalign ((void**)&async, XVFBSYNC_CACHE_LINE, sizeof (*async))) {
+    xvfbsync_print ("Couldn't allocate the submission ring\n");
+    return NULL;
+  }
+
+  memset (async, 0, sizeof (*async));
+  atomic_init (&async->tail, 0);
+  atomic_init (&async->head, 0);
+  atomic_init (&async->completed, 0);
+  atomic_init (&async->sleeping, false);
+  atomic_init (&async->quit, false);
+  async->config = *config;
+  async->config.capacity = config->capacity ? config->capacity : XVFBSYNC_ASYNC_DEFAULT_CAPACITY;
+  async->config.spinNs = config->spinNs ? config->spinNs : XVFBSYNC_ASYNC_DEFAULT_SPIN_NS;
+  async->encSyncChan = encSyncChan;
+  async->ring = calloc (async->config.capacity, sizeof (LLP2Buf*));
+  async->wakeFd = eventfd (0, EFD_CLOEXEC);
+
+  if (!async->ring || async->wakeFd == -1) {
+    xvfbsync_print ("Couldn't allocate the submission ring\n");
+    goto fail;
+  }
+
+  if (pthread_create (&async->thread, NULL, &xvfbsync_async_routine, async)) {
+    xvfbsync_print ("Couldn't create the submitter thread\n");
+    goto fail;
+  }
+
+  return async;
+
+fail:
+  if (async->wakeFd != -1)
+    close (async->wakeFd);
+  free (async->ring);
+  free (async);
+  return NULL;
 }
 
-static void xvfbsync_syncChan_disable (struct SyncChannel1* syncChan)
+/* The requests already pushed are performed before the thread stops */
+static void xvfbsync_async_stop(struct AsyncSubmitter1* async)
 {
-  if (!syncChan->enabled)
-    assert (0 == "Tried to disable a channel twice");
+  uint64_t quit = 1;
 
-  xvfbsync_syncIP_disableChannel (syncChan->sync, syncChan->id);
-  syncChan->enabled = false;
-  printf ("Disable channel %d\n", syncChan->id);
+  atomic_store_explicit (&async->quit, true, memory_order_release);
+
+  if (write (async->wakeFd, &quit, sizeof (quit)) != sizeof (quit))
+    xvfbsync_print ("Couldn't wake up the submitter thread\n");
+
+  pthread_join (async->thread, NULL);
+  close (async->wakeFd);
+  free (async->ring);
+  free (async);
 }
 
-/* ***************** */
-/* xvfbsync syncChan */
-/* ***************** */
+/* ******************** */
+/* xvfbsync encSyncChan */
+/* ******************** */
 
-static void xvfbsync_syncChan_populate (struct SyncChannel1* syncChan, struct SyncIp1* syncIP, int id)
+void xvfbsync_encSyncChan_addBuffer(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf)
 {
-  syncChan->sync = syncIP;
-  syncChan->id = id;
-  syncChan->enabled = false;
-  xvfbsync_syncIP_addListener(syncIP, id, &xvfbsync_syncChan_listener);
+  pthread_mutex_lock (&encSyncChan->mutex);  
+  xvfbsync_encSyncChan_addBuffer_ (encSyncChan, buf, 1);
+  pthread_mutex_unlock (&encSyncChan->mutex);
 }
 
-static void xvfbsync_syncChan_depopulate (struct SyncChannel1* syncChan)
+int xvfbsync_encSyncChan_addBuffers(struct EncSyncChannel1* encSyncChan, LLP2Buf** bufs, int numBufs)
 {
-  if(syncChan->enabled)
-    xvfbsync_syncChan_disable (syncChan);
+  /* nothing is queued if one of the buffers is invalid */
+  for (int i = 0; i < numBufs; ++i)
+  {
+    if (!bufs[i] || !xvfbsync_format_lookup (bufs[i]->tFourCC)) {
+      xvfbsync_print ("Invalid buffer %d in batch\n", i);
+      return -1;
+    }
+  }
 
-  xvfbsync_syncIP_removeListener(syncChan->sync, syncChan->id);
-}
+  int ret = 0;
 
-/* ******************** */
-/* xvfbsync decSyncChan */
-/* ******************** */
+  pthread_mutex_lock (&encSyncChan->mutex);
 
-void xvfbsync_decSyncChan_addBuffer(struct DecSyncChannel1* decSyncChan, LLP2Buf* buf)
+  if (encSyncChan->isRunning) {
+    /* we do not support adding buffer when the pipeline is running */
+    pthread_mutex_unlock (&encSyncChan->mutex);
+    xvfbsync_print ("Couldn't add buffers to running channel %d\n", encSyncChan->syncChannel.id);
+    return -1;
+  }
+
+  if (xvfbsync_queue_reserve (&encSyncChan->buffers, numBufs)) {
+    pthread_mutex_unlock (&encSyncChan->mutex);
+    xvfbsync_print ("Couldn't queue %d buffers\n", numBufs);
+    return -1;
+  }
+
+  for (int i = 0; i < numBufs && !ret; ++i)
+    ret = xvfbsync_encSyncChan_queueBuffer (encSyncChan, bufs[i], xvfbsync_format_lookup (bufs[i]->tFourCC));
+
+  pthread_mutex_unlock (&encSyncChan->mutex);
+  return ret;
+}
+
+void xvfbsync_encSyncChan_enable(struct EncSyncChannel1* encSyncChan)
 {
-  struct xvsfsync_chan_config config = setDecFrameBufferConfig(decSyncChan->syncChannel.id, buf);
-  //printFrameBufferConfig(config, decSyncChan->syncChannel->sync->maxUsers, decSyncChan->syncChannel->sync->maxCores);
+  pthread_mutex_lock (&encSyncChan->mutex);
 
-  xvfbsync_syncIP_addBuffer(decSyncChan->syncChannel.sync, &config);
-  printf ("Pushed buffer in sync ip\n");
-  //printChannelStatus(sync->getStatus(id));
+  /* the buffers submitted before enable would be rejected once running */
+  while (encSyncChan->async && atomic_load_explicit (&encSyncChan->async->completed, memory_order_acquire) < atomic_load_explicit (&encSyncChan->async->tail, memory_order_acquire))
+    pthread_cond_wait (&encSyncChan->submitted, &encSyncChan->mutex);
+
+  encSyncChan->isRunning = true;
+  xvfbsync_encSyncChan_prepareConfigs (encSyncChan);
+
+  if (encSyncChan->autoRecycle && !encSyncChan->syncChannel.sync->trackFbDone)
+    xvfbsync_print ("Framebuffer completions aren't reported, channel %d won't recycle its buffers\n", encSyncChan->syncChannel.id);
+
+  xvfbsync_encSyncChan_prime (encSyncChan);
+
+  xvfbsync_syncIP_enableChannel (encSyncChan->syncChannel.sync, encSyncChan->syncChannel.id);
+  encSyncChan->syncChannel.enabled = true;
+  xvfbsync_print ("Enable channel %d\n", encSyncChan->syncChannel.id);
+  pthread_mutex_unlock (&encSyncChan->mutex);
 }
 
-void xvfbsync_decSyncChan_enable(struct DecSyncChannel1* decSyncChan)
+int xvfbsync_encSyncChan_setCoreSplit(struct EncSyncChannel1* encSyncChan, const struct CoreSplit1* split)
 {
-  xvfbsync_syncIP_enableChannel (decSyncChan->syncChannel.sync, decSyncChan->syncChannel.id);
-  decSyncChan->syncChannel.enabled = true;
+  pthread_mutex_lock (&encSyncChan->mutex);
+
+  if (encSyncChan->isRunning) {
+    pthread_mutex_unlock (&encSyncChan->mutex);
+    xvfbsync_print ("Couldn't change the core split of running channel %d\n", encSyncChan->syncChannel.id);
+    return -1;
+  }
+
+  int ret = xvfbsync_syncChan_setCoreSplit (&encSyncChan->syncChannel, split);
+
+  /* the cached configs are rebuilt on enable */
+  for (unsigned int i = 0; i < encSyncChan->buffers.size && !ret; ++i)
+    encSyncChan->buffers.entries[(encSyncChan->buffers.head + i) & (encSyncChan->buffers.capacity - 1)].configValid = false;
+
+  pthread_mutex_unlock (&encSyncChan->mutex);
+  return ret;
 }
 
-void xvfbsync_decSyncChan_populate(struct DecSyncChannel1* decSyncChan, struct SyncIp1* syncIP, int id)
+int xvfbsync_encSyncChan_getEventFd(struct EncSyncChannel1* encSyncChan)
 {
-  xvfbsync_syncChan_populate (&(decSyncChan->syncChannel), syncIP, id);
+  return xvfbsync_syncChan_getEventFd (&encSyncChan->syncChannel);
 }
 
-void xvfbsync_decSyncChan_depopulate(struct DecSyncChannel1* decSyncChan)
+uint32_t xvfbsync_encSyncChan_drainEvents(struct EncSyncChannel1* encSyncChan)
 {
-  xvfbsync_syncChan_depopulate (&(decSyncChan->syncChannel));
+  return xvfbsync_syncChan_drainEvents (&encSyncChan->syncChannel);
 }
 
-/* **************************** */
-/* xvfbsync encSyncChan helpers */
-/* **************************** */
+int xvfbsync_encSyncChan_setAutoRecycle(struct EncSyncChannel1* encSyncChan, bool autoRecycle)
+{
+  pthread_mutex_lock (&encSyncChan->mutex);
+
+  if (encSyncChan->isRunning) {
+    pthread_mutex_unlock (&encSyncChan->mutex);
+    xvfbsync_print ("Couldn't change the recycling mode of running channel %d\n", encSyncChan->syncChannel.id);
+    return -1;
+  }
+
+  encSyncChan->autoRecycle = autoRecycle;
+  pthread_mutex_unlock (&encSyncChan->mutex);
+  return 0;
+}
 
-static void xvfbsync_encSyncChan_addBuffer_(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf, int numFbToEnable)
+int xvfbsync_encSyncChan_setAsync(struct EncSyncChannel1* encSyncChan, const struct AsyncSubmit1* async)
 {
-  if (buf)
-  {
-    /* we do not support adding buffer when the pipeline is running */
-    assert (!encSyncChan->isRunning);
-    xvfbsync_queue_push (&encSyncChan->buffers, buf);
+  if (async && (async->capacity < 0 || (async->capacity & (async->capacity - 1)))) {
+    xvfbsync_print ("Invalid submission ring capacity %d\n", async->capacity);
+    return -1;
   }
 
-  /* If we don't want to start the ip yet, we do not program
-   * the ip registers, we just keep the buffer in our queue
-   *
-   * When we start the channel, we try to add as much buffer
-   * as we can inside the hw ip.
-   *
-   * Once we are running, we keep the same set of buffer and when
-   * one of the buffer is finished we replace it with a new one from the queue
-   * in a round robin fashion */
+  pthread_mutex_lock (&encSyncChan->mutex);
 
-  while(encSyncChan->isRunning && numFbToEnable > 0 && !xvfbsync_queue_empty (&encSyncChan->buffers))
-  {
-    buf = xvfbsync_queue_front (&encSyncChan->buffers);
+  if (encSyncChan->isRunning) {
+    pthread_mutex_unlock (&encSyncChan->mutex);
+    xvfbsync_print ("Couldn't change the submission mode of running channel %d\n", encSyncChan->syncChannel.id);
+    return -1;
+  }
 
-    struct xvsfsync_chan_config config = setEncFrameBufferConfig(encSyncChan->syncChannel.id, buf, encSyncChan->hardwareHorizontalStrideAlignment, encSyncChan->hardwareVerticalStrideAlignment);
-    //printFrameBufferConfig(config, sync->maxUsers, sync->maxCores);
+  struct AsyncSubmitter1* previous = encSyncChan->async;
+  encSyncChan->async = NULL;
+  pthread_mutex_unlock (&encSyncChan->mutex);
 
-    xvfbsync_syncIP_addBuffer(encSyncChan->syncChannel.sync, &config);
-    printf ("Pushed buffer in sync ip\n");
-    //printChannelStatus(sync->getStatus(id));
-    xvfbsync_queue_pop (&encSyncChan->buffers);
+  /* stopped outside of the channel lock, the submitter takes it */
+  if (previous)
+    xvfbsync_async_stop (previous);
 
-    xvfbsync_queue_push (&encSyncChan->buffers, buf);
-    --numFbToEnable;
+  if (!async)
+    return 0;
+
+  struct AsyncSubmitter1* submitter = xvfbsync_async_start (encSyncChan, async);
+
+  if (!submitter)
+    return -1;
+
+  pthread_mutex_lock (&encSyncChan->mutex);
+  encSyncChan->async = submitter;
+  pthread_mutex_unlock (&encSyncChan->mutex);
+  return 0;
+}
+
+uint64_t xvfbsync_encSyncChan_submit(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf)
+{
+  struct AsyncSubmitter1* async = encSyncChan->async;
+
+  if (!async)
+    return 0;
+
+  uint64_t tail = atomic_load_explicit (&async->tail, memory_order_relaxed);
+
+  if (tail - atomic_load_explicit (&async->head, memory_order_acquire) >= (uint64_t)async->config.capacity)
+    return 0;
+
+  async->ring[tail & (async->config.capacity - 1)] = buf;
+  atomic_store_explicit (&async->tail, tail + 1, memory_order_seq_cst);
+
+  /* pairs with the check the submitter does after setting sleeping */
+  if (atomic_load_explicit (&async->sleeping, memory_order_seq_cst))
+  {
+    uint64_t wake = 1;
+
+    if (write (async->wakeFd, &wake, sizeof (wake)) != sizeof (wake))
+      xvfbsync_print ("Couldn't wake up the submitter thread\n");
   }
+
+  return tail + 1;
 }
 
-/* ******************** */
-/* xvfbsync encSyncChan */
-/* ******************** */
+bool xvfbsync_encSyncChan_isSubmitted(struct EncSyncChannel1* encSyncChan, uint64_t ticket)
+{
+  struct AsyncSubmitter1* async = encSyncChan->async;
 
-void xvfbsync_encSyncChan_addBuffer(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf)
+  /* everything was performed when the submitter stopped */
+  if (!async)
+    return true;
+
+  return atomic_load_explicit (&async->completed, memory_order_acquire) >= ticket;
+}
+
+int xvfbsync_encSyncChan_setRecovery(struct EncSyncChannel1* encSyncChan, const struct RecoveryPolicy1* policy)
 {
-  pthread_mutex_lock (&encSyncChan->mutex);  
-  xvfbsync_encSyncChan_addBuffer_ (encSyncChan, buf, 1);
+  pthread_mutex_lock (&encSyncChan->mutex);
+  int ret = xvfbsync_syncChan_setRecovery (&encSyncChan->syncChannel, policy);
   pthread_mutex_unlock (&encSyncChan->mutex);
+  return ret;
 }
 
-void xvfbsync_encSyncChan_enable(struct EncSyncChannel1* encSyncChan)
+void xvfbsync_encSyncChan_getRecoveryStats(struct EncSyncChannel1* encSyncChan, struct RecoveryStats1* stats)
 {
   pthread_mutex_lock (&encSyncChan->mutex);
-  encSyncChan->isRunning = true;
-  int numFbToEnable = MIN((int)encSyncChan->buffers.size, encSyncChan->syncChannel.sync->maxBuffers);
-  xvfbsync_encSyncChan_addBuffer_ (encSyncChan, NULL, numFbToEnable);
-  xvfbsync_syncIP_enableChannel (encSyncChan->syncChannel.sync, encSyncChan->syncChannel.id);
-  encSyncChan->syncChannel.enabled = true;
-  printf ("Enable channel %d\n", encSyncChan->syncChannel.id);
+  *stats = encSyncChan->syncChannel.recoveryStats;
   pthread_mutex_unlock (&encSyncChan->mutex);
 }
 
-void xvfbsync_encSyncChan_populate (struct EncSyncChannel1* encSyncChan, struct SyncIp1* syncIP, int id, int hardwareHorizontalStrideAlignment, int hardwareVerticalStrideAlignment)
+int xvfbsync_encSyncChan_populate (struct EncSyncChannel1* encSyncChan, struct SyncIp1* syncIP, int id, int hardwareHorizontalStrideAlignment, int hardwareVerticalStrideAlignment)
 {
-  xvfbsync_syncChan_populate (&(encSyncChan->syncChannel), syncIP, id);
+  if (xvfbsync_syncChan_populate (&(encSyncChan->syncChannel), syncIP, id))
+    return -1;
+
   encSyncChan->isRunning = false;
+  encSyncChan->autoRecycle = false;
+  encSyncChan->async = NULL;
   encSyncChan->hardwareHorizontalStrideAlignment = hardwareHorizontalStrideAlignment;
   encSyncChan->hardwareVerticalStrideAlignment = hardwareVerticalStrideAlignment;
   if (pthread_mutex_init (&(encSyncChan->mutex), NULL)) {
-    printf ("Couldn't intialize lock");
-    return;
+    xvfbsync_print ("Couldn't intialize lock");
+    xvfbsync_syncChan_depopulate (&(encSyncChan->syncChannel));
+    return -1;
   }
-  xvfbsync_queue_init (&(encSyncChan->buffers));  
+  if (pthread_cond_init (&(encSyncChan->submitted), NULL)) {
+    xvfbsync_print ("Couldn't intialize condition");
+    pthread_mutex_destroy (&(encSyncChan->mutex));
+    xvfbsync_syncChan_depopulate (&(encSyncChan->syncChannel));
+    return -1;
+  }
+  if (xvfbsync_queue_init (&(encSyncChan->buffers), XVFBSYNC_QUEUE_INITIAL_CAPACITY)) {
+    xvfbsync_print ("Couldn't allocate the buffer queue");
+    pthread_cond_destroy (&(encSyncChan->submitted));
+    pthread_mutex_destroy (&(encSyncChan->mutex));
+    xvfbsync_syncChan_depopulate (&(encSyncChan->syncChannel));
+    return -1;
+  }
+  /* recycles the slots in auto recycle mode and restarts the channel on errors */
+  xvfbsync_syncIP_setEventHandler (syncIP, id, &xvfbsync_encSyncChan_onEvents, encSyncChan);
+  return 0;
 }
 
 void xvfbsync_encSyncChan_depopulate (struct EncSyncChannel1* encSyncChan)
 {
+  /* the pending requests are performed on the running channel */
+  if (encSyncChan->async) {
+    xvfbsync_async_stop (encSyncChan->async);
+    encSyncChan->async = NULL;
+  }
+
   xvfbsync_syncChan_depopulate (&encSyncChan->syncChannel);
 
   while (!xvfbsync_queue_empty (&encSyncChan->buffers))
   {
-    LLP2Buf* buf = xvfbsync_queue_front (&encSyncChan->buffers);
-    free(buf);
+    struct QueueEntry* entry = xvfbsync_queue_front (&encSyncChan->buffers);
+    free(entry->buf);
     xvfbsync_queue_pop (&encSyncChan->buffers);
   }
+
+  xvfbsync_queue_deinit (&encSyncChan->buffers);
+  pthread_cond_destroy (&(encSyncChan->submitted));
+  pthread_mutex_destroy (&(encSyncChan->mutex));
 }
@@ -1,7 +1,11 @@
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 typedef uint8_t u8;
 typedef uint32_t u32;
@@ -12,6 +16,26 @@ typedef uint64_t u64;
 #define BIT(x) (1 << (x))
 #define MAX_FB_NUMBER 3
 #define MAX_USER 2 /* consumer and producter */
+#define XVFBSYNC_QUEUE_INITIAL_CAPACITY 8 /* must be a power of two */
+#define XVFBSYNC_CACHE_LINE 64
+#define XVFBSYNC_TRACE_SIZE 1024 /* must be a power of two */
+#define XVFBSYNC_HISTOGRAM_SUB_BITS 3 /* 8 buckets per power of two */
+#define XVFBSYNC_HISTOGRAM_MAX_BITS 40 /* values are clamped to 2^40 ns (~18 min) */
+#define XVFBSYNC_HISTOGRAM_BUCKETS ((XVFBSYNC_HISTOGRAM_MAX_BITS - XVFBSYNC_HISTOGRAM_SUB_BITS + 1) << XVFBSYNC_HISTOGRAM_SUB_BITS)
+#define XVFBSYNC_DMABUF_CACHE_SIZE 64
+#define XVFBSYNC_MARGIN_MAX_BACKOFF 64 /* the margin quiet period grows up to 64 times */
+#define XVFBSYNC_MANAGER_MAX_DEVICES 8
+#define XVFBSYNC_MANAGER_DEFAULT_PATTERN "/dev/xvsfsync*"
+#define XVFBSYNC_STATUS_MAX_AGE_NS 1000000 /* staleness bound of the channel search */
+#define XVFBSYNC_STATS_MAGIC 0x53425658 /* "XVBS" */
+#define XVFBSYNC_STATS_VERSION 1
+#define XVFBSYNC_RECORD_MAGIC 0x43525658 /* "XVRC" */
+#define XVFBSYNC_RECORD_VERSION 1
+#define XVFBSYNC_REPLAY_PACING_NS 1000000000 /* longest wait of a replayed config for a free slot */
+#define XVFBSYNC_REPLAY_RETRY_NS 50000
+#define XVFBSYNC_ASYNC_DEFAULT_CAPACITY 16
+#define XVFBSYNC_ASYNC_DEFAULT_SPIN_NS 100000
+#define XVFBSYNC_DEC_RETRY_NS 1000000 /* delay before a decoder buffer the driver had no slot for is tried again */
 
 #define XVFBSYNC_FOURCC2(A, B, C, D) ((uint32_t)(((uint32_t)((A))) \
                                        | ((uint32_t)((B)) << 8) \
@@ -63,6 +87,22 @@ typedef struct tFourCCMapping1
   TPicFormat tPictFormat;
 } TFourCCMapping;
 
+/* Format properties resolved once per fourcc, so the config builders never
+ * rescan the FourCC table */
+typedef struct t_FormatDesc1
+{
+  uint32_t tFourCC;
+  TPicFormat tPicFormat;
+  bool bMonochrome;
+  bool bSemiPlanar;
+  bool bTiled;
+  int iChromaPlanes; /* 0: monochrome, 1: semi-planar, 2: planar */
+  int iVerticalFactor; /* chroma vertical subsampling */
+  int iTileWidth; /* pixels, 1 in raster */
+  int iTileHeight; /* lines, 1 in raster */
+  int iTileBytes; /* bytes of a whole tile */
+} TFormatDesc;
+
 typedef enum e_PlaneId1
 {
   PLANE_Y,
@@ -102,31 +142,300 @@ struct ChannelStatus1
   bool chromaDiffError;
 };
 
-struct Node
+struct QueueEntry
 {
   LLP2Buf* buf;
-  struct Node* next;
+  const TFormatDesc* desc;
+  bool configValid;
+  struct xvsfsync_chan_config config; /* ready to submit config of buf */
+  int fbId; /* hardware slot holding buf in auto recycle mode, -1 if none */
+  uint64_t completedAt; /* when buf last left its hardware slot */
 };
 
 struct Queue
 {
-  struct Node* front;
-  struct Node* last;
+  struct QueueEntry* entries; /* ring storage, capacity entries */
+  unsigned int capacity; /* power of two */
+  unsigned int head; /* index of the front buffer */
   unsigned int size;
 };
 
+typedef enum e_TraceEvent1
+{
+  TRACE_BUFFER_PROGRAMMED, /* arg: luma start address, result: ioctl return */
+  TRACE_CHANNEL_ENABLE,
+  TRACE_CHANNEL_DISABLE,
+  TRACE_STATUS_FETCH,
+  TRACE_ERROR, /* arg: TRACE_ERROR_* mask */
+  TRACE_IOCTL, /* arg: ioctl number, duration: time spent in the driver */
+  TRACE_MAX_ENUM, /* sentinel */
+} ETraceEvent;
+
+/* Events reported through the channel eventfds.
+ * FB_DONE is only known for slots programmed with an explicit fb_id (auto
+ * recycle encoders, decoders with framebuffer tracking): the driver doesn't
+ * tell which slot it picked for a XVSFSYNC_AUTO_SEARCH config */
+#define XVFBSYNC_EVENT_FB_DONE(fbId) BIT(fbId) /* framebuffer slot fbId was released */
+#define XVFBSYNC_EVENT_FB_DONE_MASK (BIT(MAX_FB_NUMBER) - 1)
+#define XVFBSYNC_EVENT_SYNC_ERROR BIT(8)
+#define XVFBSYNC_EVENT_WATCHDOG_ERROR BIT(9)
+#define XVFBSYNC_EVENT_LUMA_DIFF_ERROR BIT(10)
+#define XVFBSYNC_EVENT_CHROMA_DIFF_ERROR BIT(11)
+#define XVFBSYNC_EVENT_RECOVERED BIT(12) /* the channel was restarted after an error */
+#define XVFBSYNC_EVENT_RECOVERY_FAILED BIT(13) /* the channel gave up restarting, it stays disabled */
+#define XVFBSYNC_EVENT_BUFFER_REJECTED BIT(16) /* the driver refused a queued buffer, it was dropped */
+
+#define TRACE_ERROR_SYNC BIT(0)
+#define TRACE_ERROR_WATCHDOG BIT(1)
+#define TRACE_ERROR_LUMA_DIFF BIT(2)
+#define TRACE_ERROR_CHROMA_DIFF BIT(3)
+
+struct TraceEvent1
+{
+  uint64_t timestamp; /* CLOCK_MONOTONIC in ns */
+  uint32_t arg;
+  int32_t result;
+  uint32_t duration; /* in ns */
+  uint16_t type; /* ETraceEvent */
+  int16_t channel; /* -1 when not related to a channel */
+};
+
+/* packed form of struct TraceEvent1, stored with atomic words so writers
+ * and readers never race on the payload */
+struct TraceSlot1
+{
+  _Atomic uint64_t seq;
+  _Atomic uint64_t timestamp;
+  _Atomic uint64_t argResult;
+  _Atomic uint64_t durationTypeChannel;
+};
+
+typedef enum e_LatencyKind1
+{
+  LATENCY_PRODUCER_DONE, /* buffer programmed -> producer done */
+  LATENCY_CONSUMER_DONE, /* buffer programmed -> consumer done */
+  LATENCY_PRODUCER_TO_CONSUMER, /* producer done -> consumer done */
+  LATENCY_MAX_ENUM, /* sentinel */
+} ELatencyKind;
+
+struct LatencyHistogram1
+{
+  _Atomic uint64_t counts[XVFBSYNC_HISTOGRAM_BUCKETS];
+  _Atomic uint64_t total;
+  _Atomic uint64_t sum; /* in ns */
+  _Atomic uint64_t max; /* in ns */
+};
+
+struct LatencyHistogramSnapshot1
+{
+  uint64_t counts[XVFBSYNC_HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t sum; /* in ns */
+  uint64_t max; /* in ns */
+};
+
+struct ChannelLatency1
+{
+  pthread_mutex_t mutex; /* protects the framebuffer slot tracking */
+  uint64_t programmedAt[MAX_FB_NUMBER]; /* 0 when the slot is free */
+  uint64_t doneAt[MAX_FB_NUMBER][MAX_USER];
+  struct LatencyHistogram1 histograms[LATENCY_MAX_ENUM];
+};
+
+typedef enum e_StatsError1
+{
+  STATS_ERROR_SYNC,
+  STATS_ERROR_WATCHDOG,
+  STATS_ERROR_LUMA_DIFF,
+  STATS_ERROR_CHROMA_DIFF,
+  STATS_ERROR_MAX_ENUM, /* sentinel */
+} EStatsError;
+
+/* Counters of a channel (or of the whole device) in the statistics
+ * segment, they only grow */
+struct StatsCounters1
+{
+  _Atomic uint64_t buffersProgrammed;
+  _Atomic uint64_t framebuffersDone; /* slots released by their producer and consumer */
+  _Atomic uint64_t ioctls;
+  _Atomic uint64_t ioctlFailures;
+  _Atomic uint64_t ioctlTimeNs; /* time spent in the driver */
+  _Atomic uint64_t errors[STATS_ERROR_MAX_ENUM];
+  _Atomic uint64_t recoveries;
+  _Atomic uint64_t buffersRejected; /* refused by the driver and dropped */
+} __attribute__((aligned (XVFBSYNC_CACHE_LINE)));
+
+/* Layout of the statistics segment, shared with other processes.
+ * Readers check magic and version, then find channel n at
+ * headerSize + n * countersSize. Fields are only ever added at the end of
+ * the structs, anything else bumps XVFBSYNC_STATS_VERSION */
+struct StatsSegment1
+{
+  _Atomic uint32_t magic; /* XVFBSYNC_STATS_MAGIC once the layout fields are set */
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t countersSize;
+  uint32_t numChannels;
+  uint32_t encode;
+  uint64_t createdAt; /* CLOCK_MONOTONIC in ns */
+  struct StatsCounters1 device; /* ioctls not related to a channel */
+  struct StatsCounters1 channels[]; /* numChannels entries */
+};
+
+/* An ioctl recording is a RecordHeader1 followed by one RecordEntry1 per
+ * ioctl, each followed by argSize bytes: the struct the argument pointed
+ * to once the ioctl returned. All in host byte order */
+struct RecordHeader1
+{
+  uint32_t magic; /* XVFBSYNC_RECORD_MAGIC */
+  uint32_t version;
+  uint32_t encode;
+  uint32_t maxChannels;
+  uint64_t startedAt; /* CLOCK_MONOTONIC in ns */
+};
+
+struct RecordEntry1
+{
+  uint64_t timestamp; /* ns since the recording started */
+  uint64_t argValue; /* argument passed by value, when argSize is 0 */
+  uint32_t request;
+  int32_t result;
+  int32_t chanId; /* -1 when not related to a channel */
+  uint32_t duration; /* in ns */
+  uint32_t argSize;
+  uint32_t reserved;
+};
+
+/* How the library talks to the driver. The default ops call ioctl() and
+ * poll() on the device fd, other ops can stand in for the device (e.g. to
+ * run without the hardware) */
+struct SyncIpDeviceOps1
+{
+  int (*ioctl) (void* opaque, int fd, unsigned long request, void* arg);
+  int (*poll) (void* opaque, struct pollfd* fds, nfds_t nfds, int timeout);
+};
+
+/* Everything the sync ip keeps for one channel, on its own cache lines */
+struct ChannelState1
+{
+  _Atomic uint32_t status; /* packed struct ChannelStatus1 */
+  pthread_mutex_t mutex; /* protects listener, eventHandler and notifyFd */
+  void (*listener) (struct ChannelStatus1*);
+  void (*eventHandler) (void* opaque, uint32_t events); /* XVFBSYNC_EVENT_* */
+  void* eventOpaque;
+  int notifyFd; /* eventfd readable while events are pending, -1 if none */
+  _Atomic uint32_t pendingEvents; /* XVFBSYNC_EVENT_* */
+  _Atomic uint64_t retryAt; /* when the event handler gets XVFBSYNC_EVENT_RETRY, 0 if never */
+  bool errorsHandled; /* the event handler cleared the errors of the channel itself */
+  struct ChannelLatency1 latency;
+} __attribute__((aligned (XVFBSYNC_CACHE_LINE)));
+
+typedef enum e_ThreadingMode1
+{
+  THREADING_DEDICATED, /* the sync ip handles its events on its own thread */
+  THREADING_NONE, /* the application calls xvfbsync_syncIP_processEvents */
+} EThreadingMode;
+
+/* How the sync ip handles the events of the device, the default (all zero)
+ * is a dedicated thread with the default scheduling */
+struct SyncIpOptions1
+{
+  EThreadingMode eThreading;
+  uint64_t cpuMask; /* bit n lets the thread run on cpu n, 0: any cpu */
+  int priority; /* SCHED_FIFO priority of the thread, 0: SCHED_OTHER */
+};
+
+/* dmabuf -> physical address, as resolved by the driver */
+struct DmaBufCacheEntry1
+{
+  dev_t dev;
+  ino_t ino;
+  uint32_t phyAddr;
+  bool valid;
+};
+
+struct SyncIpManager1;
+
 struct SyncIp1
 {
+  bool encode;
   int maxChannels;
   int maxUsers;
   int maxBuffers;
   int maxCores;
   int fd;
-  bool quit;
+  const struct SyncIpDeviceOps1* ops;
+  void* opsOpaque;
+  struct SyncIpManager1* manager; /* NULL when the sync ip isn't managed */
+  int managerRefs; /* event thread dispatches in progress, protected by the manager mutex */
+  EThreadingMode eThreading;
+  int quitFd; /* eventfd used to wake up and stop the polling thread */
+  int retryFd; /* eventfd waking up the event thread when an earlier retry is armed */
   pthread_t pollingThread;
-  pthread_mutex_t mutex;
-  void (*(*eventListeners)) (struct ChannelStatus1*); 
-  struct ChannelStatus1* channelStatuses;
+  struct ChannelState1* channels; /* maxChannels entries */
+  _Atomic uint32_t reservedChannels; /* bit n set when channel n is in use */
+  _Atomic uint32_t populatedChannels; /* bit n set while a channel is populated on channel n */
+  bool trackFbDone; /* false if the driver can't report framebuffer completions */
+  _Atomic uint64_t statusGeneration; /* bumped by every channel status refresh */
+  _Atomic uint64_t statusRefreshedAt; /* when the channel statuses were last fetched */
+  _Atomic bool statusStale; /* the device may have changed them since */
+  struct TraceSlot1* traceSlots; /* XVFBSYNC_TRACE_SIZE entries */
+  _Atomic uint64_t traceHead;
+  pthread_mutex_t dmaBufMutex; /* protects the dmabuf cache */
+  struct DmaBufCacheEntry1 dmaBufs[XVFBSYNC_DMABUF_CACHE_SIZE];
+  unsigned int dmaBufNext; /* next cache entry to replace */
+  struct StatsSegment1* stats; /* NULL if it couldn't be mapped */
+  size_t statsSize;
+  int statsFd; /* memfd holding stats, -1 if none */
+  _Atomic bool recording;
+  pthread_mutex_t recordMutex; /* protects recordFile */
+  FILE* recordFile;
+  uint64_t recordStart;
+};
+
+/* Several sync ips whose events are all handled by a single thread */
+struct SyncIpManager1
+{
+  int epollFd;
+  int quitFd; /* eventfd used to wake up and stop the event thread */
+  pthread_t eventThread;
+  pthread_mutex_t mutex; /* protects the devices */
+  pthread_cond_t dispatched; /* signaled when the event thread releases the devices */
+  struct SyncIp1* devices[XVFBSYNC_MANAGER_MAX_DEVICES];
+  bool ownsDevice[XVFBSYNC_MANAGER_MAX_DEVICES]; /* opened by discover */
+  uint64_t keys[XVFBSYNC_MANAGER_MAX_DEVICES]; /* epoll keys, never reused, 0 is the quit event */
+  uint64_t nextKey;
+  int numDevices;
+};
+
+typedef enum e_CorePartition1
+{
+  CORE_PARTITION_COLUMNS, /* each core handles a column of LCUs */
+  CORE_PARTITION_ROWS, /* each core handles a band of lines (slices) */
+} ECorePartition;
+
+/* How the frame is shared between the cores of a multi-core codec */
+struct CoreSplit1
+{
+  int numCores; /* 1 to XVSFSYNC_MAX_CORES */
+  ECorePartition ePartition;
+  int iUnitSize; /* in pixels: LCU width for columns, slice height for rows */
+};
+
+/* In place restart of a channel after a sync or watchdog error */
+struct RecoveryPolicy1
+{
+  int maxRetries; /* restarts without a completed frame in between before giving up */
+  uint64_t backoffNs; /* wait before the second restart, doubled by each following one */
+  uint64_t maxBackoffNs; /* longest wait, the event thread keeps handling the other channels meanwhile */
+};
+
+struct RecoveryStats1
+{
+  uint64_t errors; /* sync and watchdog errors reported */
+  uint64_t recoveries; /* restarts */
+  uint64_t failures; /* times the channel gave up */
+  uint64_t lastRecoveryNs; /* duration of the last restart */
 };
 
 struct SyncChannel1
@@ -134,6 +443,45 @@ struct SyncChannel1
   int id;
   bool enabled;
   struct SyncIp1* sync;
+  struct CoreSplit1 coreSplit; /* one core by default */
+  bool recover; /* restart on sync and watchdog errors */
+  struct RecoveryPolicy1 recoveryPolicy;
+  struct RecoveryStats1 recoveryStats;
+  int recoveryAttempts; /* restarts since the last completed frame */
+  uint64_t restartAt; /* when the deferred restart is due, 0 if none */
+  bool reserved; /* the channel holds the reservation of its id */
+};
+
+/* Asynchronous submission of an encoder channel */
+struct AsyncSubmit1
+{
+  void (*callback) (void* opaque, uint64_t ticket, int result); /* on the submitter thread, can be NULL */
+  void* opaque;
+  int capacity; /* requests the ring holds, a power of two, 0: XVFBSYNC_ASYNC_DEFAULT_CAPACITY */
+  /* the submitter polls the ring that long before it sleeps, yielding its
+   * core meanwhile, 0: XVFBSYNC_ASYNC_DEFAULT_SPIN_NS. A submit only pays an
+   * eventfd write when the submitter sleeps, so the spin should cover the
+   * interval between submissions (a short one trades that back for less
+   * polling) */
+  uint64_t spinNs;
+};
+
+struct EncSyncChannel1;
+
+/* Single producer single consumer ring of addBuffer requests, emptied by
+ * the submitter thread */
+struct AsyncSubmitter1
+{
+  _Atomic uint64_t tail __attribute__((aligned (XVFBSYNC_CACHE_LINE))); /* written by the submitting thread */
+  _Atomic uint64_t head __attribute__((aligned (XVFBSYNC_CACHE_LINE))); /* written by the submitter thread */
+  _Atomic uint64_t completed; /* ticket of the last request performed */
+  _Atomic bool sleeping; /* the submitter waits for wakeFd */
+  _Atomic bool quit;
+  int wakeFd;
+  pthread_t thread;
+  struct AsyncSubmit1 config;
+  LLP2Buf** ring; /* config.capacity entries */
+  struct EncSyncChannel1* encSyncChan;
 };
 
 struct EncSyncChannel1
@@ -142,13 +490,43 @@ struct EncSyncChannel1
   struct Queue buffers;
   pthread_mutex_t mutex;
   bool isRunning;
+  bool autoRecycle; /* slots are refilled as soon as they are released */
+  struct AsyncSubmitter1* async; /* NULL when addBuffer is called directly */
+  pthread_cond_t submitted; /* broadcast by the submitter after each request */
   int hardwareHorizontalStrideAlignment;
   int hardwareVerticalStrideAlignment;
 };
 
+/* Limits of the decoder margin controller */
+struct MarginControl1
+{
+  uint32_t minMargin;
+  uint32_t maxMargin;
+  uint32_t step; /* added on error, removed after a quiet period */
+  int quietFrames; /* frames without error before the margin is decreased */
+};
+
+struct MarginState1
+{
+  uint32_t margin;
+  int quiet; /* frames without error since last change */
+  int requiredQuiet; /* frames without error needed before next decrease */
+  bool lowered; /* the margin was decreased since the last error */
+};
+
 struct DecSyncChannel1
 {
   struct SyncChannel1 syncChannel;
+  struct Queue buffers; /* buffers waiting for a hardware slot */
+  pthread_mutex_t mutex;
+  bool isRunning;
+  uint32_t busySlots; /* bit n set while hardware slot n holds a buffer */
+  struct xvsfsync_chan_config slots[MAX_FB_NUMBER]; /* config programmed in each busy slot */
+  struct MarginState1 lumaMargin;
+  struct MarginState1 chromaMargin;
+  bool adaptiveMargins;
+  struct MarginControl1 marginControl;
+  int lcuSize; /* 0 if the decoder writes raster lines */
 };
 
 struct ThreadInfo
@@ -157,16 +535,183 @@ struct ThreadInfo
 };
 
 
+/* Reserve a free channel and return its id, -1 if there is none or if the
+ * channel statuses couldn't be read.
+ * The reservation is released when the channel is depopulated
+ * (or with xvfbsync_syncIP_releaseChannel if it is never populated) */
 int xvfbsync_syncIP_getFreeChannel(struct SyncIp1* syncIP);
+/* Reserve a given channel, returns -1 if it is already reserved */
+int xvfbsync_syncIP_reserveChannel(struct SyncIp1* syncIP, int chanId);
+void xvfbsync_syncIP_releaseChannel(struct SyncIp1* syncIP, int chanId);
+/* Copy the cached status of channel chanId to status. The cache is only
+ * fetched again from the device if the event path or a channel command
+ * changed it, or if it is older than maxAgeNs.
+ * Returns the generation of the copy, which grows with every fetch, 0 on error */
+uint64_t xvfbsync_syncIP_getChanStatus(struct SyncIp1* syncIP, int chanId, struct ChannelStatus1* status, uint64_t maxAgeNs);
 int xvfbsync_syncIP_populate (struct SyncIp1* syncIP, int fd);
+/* Same as populate, but all the driver calls go through ops (NULL: default) */
+int xvfbsync_syncIP_populateWithOps (struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque);
+/* Same as populateWithOps, with the threading model of options (NULL: default).
+ * Returns -1 if the thread can't get the requested cpus or priority */
+int xvfbsync_syncIP_populateWithOptions (struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque, const struct SyncIpOptions1* options);
+/* With THREADING_NONE, handle the completions and errors the device
+ * reported, waiting up to timeout ms for them (0: don't wait, -1: forever).
+ * The application can instead wait for POLLIN or POLLPRI on the fd given to
+ * populate in its own loop, then call it with timeout 0. Call it from a
+ * single thread. Returns -1 if the device can't be polled anymore or if
+ * the sync ip has its own thread */
+int xvfbsync_syncIP_processEvents (struct SyncIp1* syncIP, int timeout);
 void xvfbsync_syncIP_depopulate (struct SyncIp1* syncIP);
+/* Copy the most recent trace events (oldest first), returns the number copied */
+int xvfbsync_syncIP_traceSnapshot (struct SyncIp1* syncIP, struct TraceEvent1* events, int maxEvents);
+void xvfbsync_syncIP_traceDump (struct SyncIp1* syncIP, FILE* out);
+/* memfd holding the statistics segment of the sync ip (struct StatsSegment1),
+ * -1 if there is none. Other processes can map it read only and follow the
+ * counters without any call into the library: it shows up as
+ * "/memfd:xvfbsync-stats" in /proc/<pid>/fd, or the fd can be sent to them */
+int xvfbsync_syncIP_getStatsFd (struct SyncIp1* syncIP);
+const struct StatsSegment1* xvfbsync_syncIP_getStats (struct SyncIp1* syncIP);
+/* Log every ioctl issued on the sync ip to path (see struct RecordHeader1)
+ * until stopRecording or depopulate. Returns -1 if path can't be written */
+int xvfbsync_syncIP_startRecording (struct SyncIp1* syncIP, const char* path);
+void xvfbsync_syncIP_stopRecording (struct SyncIp1* syncIP);
+/* Issue the ioctls recorded in path again on the sync ip, speed times
+ * faster than they were recorded (0: back to back). The sync ip must be
+ * populated with THREADING_NONE: the recording already holds the ioctls of
+ * the event handling. A config that was accepted when recorded waits up to
+ * XVFBSYNC_REPLAY_PACING_NS for the device to release a slot, so faster
+ * replays follow the completions of the device. Dmabuf lookups are
+ * skipped, the recorded fds mean nothing here.
+ * Returns the number of ioctls whose result differs from the recording,
+ * -1 if the recording can't be read or the sync ip has its event handling */
+int xvfbsync_syncIP_replay (struct SyncIp1* syncIP, const char* path, double speed);
+/* Only the buffers programmed in an explicit slot are measured, like for
+ * XVFBSYNC_EVENT_FB_DONE, the histograms of the other channels stay empty */
+int xvfbsync_syncIP_getLatency (struct SyncIp1* syncIP, int chanId, ELatencyKind kind, struct LatencyHistogramSnapshot1* snapshot);
+void xvfbsync_syncIP_resetLatency (struct SyncIp1* syncIP, int chanId);
+/* percentile in [0, 100], returns ns */
+uint64_t xvfbsync_latency_percentile (const struct LatencyHistogramSnapshot1* snapshot, double percentile);
+/* Physical address of a dmabuf, resolved by the driver the first time and
+ * then cached by inode. Use forgetDmaBuf when the buffer is freed, so a new
+ * dmabuf can't be confused with it */
+int xvfbsync_syncIP_getDmaBufAddress(struct SyncIp1* syncIP, int dmaBufFd, uint32_t* phyAddr);
+void xvfbsync_syncIP_forgetDmaBuf(struct SyncIp1* syncIP, int dmaBufFd);
+/* Allocate a buffer ready to be added to a channel from a dmabuf and its
+ * plane layout (offsets relative to the dmabuf start), NULL on error.
+ * Like any LLP2Buf given to an encoder channel, it is freed by the channel */
+LLP2Buf* xvfbsync_syncIP_importDmaBuf(struct SyncIp1* syncIP, int dmaBufFd, uint32_t tFourCC, const struct TDimension* dim, const struct TPlane* planes, int numPlanes);
+
+int xvfbsync_manager_populate(struct SyncIpManager1* manager);
+/* Also depopulates the sync ips still managed */
+void xvfbsync_manager_depopulate(struct SyncIpManager1* manager);
+/* Populate syncIP without a polling thread of its own, its events are
+ * handled by the manager thread until it is depopulated */
+int xvfbsync_manager_addDevice(struct SyncIpManager1* manager, struct SyncIp1* syncIP, int fd, const struct SyncIpDeviceOps1* ops, void* opaque);
+/* Waits until the manager thread is done with syncIP, so it mustn't be
+ * called from the event handlers of a managed sync ip */
+void xvfbsync_manager_removeDevice(struct SyncIpManager1* manager, struct SyncIp1* syncIP);
+/* Open and add every device matching pattern (NULL: XVFBSYNC_MANAGER_DEFAULT_PATTERN),
+ * returns the number of devices added */
+int xvfbsync_manager_discover(struct SyncIpManager1* manager, const char* pattern);
+int xvfbsync_manager_getDeviceCount(struct SyncIpManager1* manager);
+struct SyncIp1* xvfbsync_manager_getDevice(struct SyncIpManager1* manager, int index);
+/* Reserve a free channel on the first encoder (or decoder) sync ip that has
+ * one, returns its id and the sync ip in syncIP, -1 if there is none */
+int xvfbsync_manager_getFreeChannel(struct SyncIpManager1* manager, bool encode, struct SyncIp1** syncIP);
 
+/* Queue buf, it is programmed as soon as a hardware slot is free (right
+ * away if the channel runs and a slot is free). Any number of buffers can
+ * wait, they are programmed in order. buf can be reused once the call
+ * returned. Can be called from several threads.
+ * A buffer the driver refuses for another reason than a busy slot is
+ * dropped and XVFBSYNC_EVENT_BUFFER_REJECTED is raised */
 void xvfbsync_decSyncChan_addBuffer(struct DecSyncChannel1* decSyncChan, LLP2Buf* buf);
+/* Queue numBufs buffers under a single lock.
+ * Returns 0 if all of them were queued, nothing is queued if one of them
+ * is invalid or if the queue can't grow */
+int xvfbsync_decSyncChan_addBuffers(struct DecSyncChannel1* decSyncChan, LLP2Buf** bufs, int numBufs);
+/* Number of buffers still waiting for a hardware slot */
+int xvfbsync_decSyncChan_getNumPending(struct DecSyncChannel1* decSyncChan);
 void xvfbsync_decSyncChan_enable(struct DecSyncChannel1* decSyncChan);
-void xvfbsync_decSyncChan_populate(struct DecSyncChannel1* decSyncChan, struct SyncIp1* syncIP, int id);
+/* Margins programmed with the following buffers (0 by default), clamped to
+ * the control limits while the margins are adaptive */
+void xvfbsync_decSyncChan_setMargins(struct DecSyncChannel1* decSyncChan, uint32_t lumaMargin, uint32_t chromaMargin);
+void xvfbsync_decSyncChan_getMargins(struct DecSyncChannel1* decSyncChan, uint32_t* lumaMargin, uint32_t* chromaMargin);
+/* Let the margins follow the error rate of the channel within control
+ * limits: a sync or luma/chroma difference error raises them, error free
+ * frames bring them back down to the smallest value that stays error free.
+ * NULL keeps the current margins fixed. Returns -1 if control is invalid */
+int xvfbsync_decSyncChan_setAdaptiveMargins(struct DecSyncChannel1* decSyncChan, const struct MarginControl1* control);
+/* Program the per-core luma/chroma offsets of the following buffers for a
+ * multi-core codec, returns -1 if split is invalid */
+int xvfbsync_decSyncChan_setCoreSplit(struct DecSyncChannel1* decSyncChan, const struct CoreSplit1* split);
+/* Producer end addresses of the following buffers cover the whole LCU row
+ * the decoder writes the last line in (16, 32 or 64), 0 ends them on the
+ * last pixel. Returns -1 if lcuSize is invalid */
+int xvfbsync_decSyncChan_setLcuSize(struct DecSyncChannel1* decSyncChan, int lcuSize);
+/* Restart the running channel in place when a sync or watchdog error is
+ * reported: the error is cleared, the channel is disabled, the buffers that
+ * were in its hardware slots are programmed again, followed by the queued
+ * ones, and the channel is enabled again. The event thread restarts it
+ * once it dispatched the pending events of all the channels, the restarts
+ * following the first one once their backoff elapsed too. In THREADING_NONE
+ * mode the processEvents call that handles the error, or the first one
+ * after the backoff, restarts it. After
+ * policy->maxRetries restarts without a completed frame the channel stays
+ * disabled and XVFBSYNC_EVENT_RECOVERY_FAILED is raised.
+ * NULL disables it (default). Returns -1 if policy is invalid */
+int xvfbsync_decSyncChan_setRecovery(struct DecSyncChannel1* decSyncChan, const struct RecoveryPolicy1* policy);
+void xvfbsync_decSyncChan_getRecoveryStats(struct DecSyncChannel1* decSyncChan, struct RecoveryStats1* stats);
+/* eventfd that becomes readable when a framebuffer slot of the channel is
+ * released or when an error is raised, -1 if it couldn't be created.
+ * It can be watched by any event loop, drainEvents then returns the
+ * XVFBSYNC_EVENT_* that fired since last call without blocking */
+int xvfbsync_decSyncChan_getEventFd(struct DecSyncChannel1* decSyncChan);
+uint32_t xvfbsync_decSyncChan_drainEvents(struct DecSyncChannel1* decSyncChan);
+/* Takes over the reservation of id if it comes from getFreeChannel or
+ * reserveChannel, reserves it otherwise. Returns -1 if id is invalid or
+ * already populated, the channel must not be depopulated then */
+int xvfbsync_decSyncChan_populate(struct DecSyncChannel1* decSyncChan, struct SyncIp1* syncIP, int id);
 void xvfbsync_decSyncChan_depopulate(struct DecSyncChannel1* decSyncChan);
 
 void xvfbsync_encSyncChan_addBuffer(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf);
+/* Queue numBufs buffers under a single lock, before the channel is enabled.
+ * Returns 0 if all of them were queued, nothing is queued if one of them is
+ * invalid or if the queue can't grow */
+int xvfbsync_encSyncChan_addBuffers(struct EncSyncChannel1* encSyncChan, LLP2Buf** bufs, int numBufs);
+/* In asynchronous mode, waits for the requests submitted before it to be
+ * performed first, the buffers they carry are queued and not rejected.
+ * Must not be called from the submission callback then */
 void xvfbsync_encSyncChan_enable(struct EncSyncChannel1* encSyncChan);
-void xvfbsync_encSyncChan_populate (struct EncSyncChannel1* encSyncChan, struct SyncIp1* syncIP, int id, int hardwareHorizontalStrideAlignment, int hardwareVerticalStrideAlignment);
+/* Same as xvfbsync_decSyncChan_setCoreSplit, only before the channel runs */
+int xvfbsync_encSyncChan_setCoreSplit(struct EncSyncChannel1* encSyncChan, const struct CoreSplit1* split);
+/* Same as xvfbsync_decSyncChan_getEventFd/drainEvents */
+int xvfbsync_encSyncChan_getEventFd(struct EncSyncChannel1* encSyncChan);
+uint32_t xvfbsync_encSyncChan_drainEvents(struct EncSyncChannel1* encSyncChan);
+/* When enabled (before the channel runs), each hardware slot released by
+ * the producer and the consumer is cleared and reprogrammed right away with
+ * the least recently completed buffer of the queue, addBuffer(NULL) is
+ * then not needed anymore. Returns -1 if the channel is running */
+int xvfbsync_encSyncChan_setAutoRecycle(struct EncSyncChannel1* encSyncChan, bool autoRecycle);
+/* Same as xvfbsync_decSyncChan_setRecovery, the slots are primed again from
+ * the buffers of the channel like enable does */
+int xvfbsync_encSyncChan_setRecovery(struct EncSyncChannel1* encSyncChan, const struct RecoveryPolicy1* policy);
+void xvfbsync_encSyncChan_getRecoveryStats(struct EncSyncChannel1* encSyncChan, struct RecoveryStats1* stats);
+/* When set (before the channel runs), submit hands addBuffer requests to a
+ * submitter thread of the channel through a lock free ring, which builds
+ * the configs and issues the ioctls instead of the caller. NULL performs
+ * the pending requests, stops the thread and goes back to direct calls.
+ * Returns -1 if the channel is running or async is invalid */
+int xvfbsync_encSyncChan_setAsync(struct EncSyncChannel1* encSyncChan, const struct AsyncSubmit1* async);
+/* Asynchronous xvfbsync_encSyncChan_addBuffer, to be called from a single
+ * thread. Returns the ticket of the request, which is passed to the
+ * callback once it was performed, 0 if the ring is full or the channel
+ * isn't asynchronous. Wakes the submitter up with an eventfd write when it
+ * sleeps, see AsyncSubmit1.spinNs */
+uint64_t xvfbsync_encSyncChan_submit(struct EncSyncChannel1* encSyncChan, LLP2Buf* buf);
+/* Requests are performed in order, true once ticket and all the requests
+ * before it were */
+bool xvfbsync_encSyncChan_isSubmitted(struct EncSyncChannel1* encSyncChan, uint64_t ticket);
+/* Same as xvfbsync_decSyncChan_populate */
+int xvfbsync_encSyncChan_populate (struct EncSyncChannel1* encSyncChan, struct SyncIp1* syncIP, int id, int hardwareHorizontalStrideAlignment, int hardwareVerticalStrideAlignment);
 void xvfbsync_encSyncChan_depopulate (struct EncSyncChannel1* encSyncChan);